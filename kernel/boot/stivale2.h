@@ -57,6 +57,8 @@ struct stivale2_struct {
 
 #define STIVALE2_STRUCT_TAG_CMDLINE_ID 0xe5e76a1b4597a781
 
+typedef struct stivale2_struct_tag_cmdline stv2_struct_tag_cmdline;
+
 struct stivale2_struct_tag_cmdline {
     struct stivale2_tag tag;
     uint64_t cmdline;
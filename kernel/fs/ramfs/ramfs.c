@@ -13,7 +13,8 @@ vfs_fsinfo_t ramfs = {
     .refresh = ramfs_refresh,
     .read = ramfs_read,
     .write = ramfs_write,
-    .setlink = ramfs_setlink
+    .setlink = ramfs_setlink,
+    .release = ramfs_release
 };
 
 // identifying information for a node
@@ -56,16 +57,20 @@ int64_t ramfs_sync(vfs_inode_t* this)
 
 int64_t ramfs_setlink(vfs_tnode_t* this, vfs_inode_t* inode)
 {
+    // we don't need to do anything, the previous inode data is freed by
+    // ramfs_release() once nothing refers to it
+    (void)this;
     (void)inode;
+    return 0;
+}
 
-    // we don't need to do anything apart from
-    // freeing the previous inode data if needed
-    if (this->inode->refcount == 0) {
-        ramfs_ident_t* id = (ramfs_ident_t*)this->inode->ident;
-        if (id->data)
-            kmfree(id->data);
-        kmfree(id);
-    }
+// frees the inode data
+int64_t ramfs_release(vfs_inode_t* this)
+{
+    ramfs_ident_t* id = (ramfs_ident_t*)this->ident;
+    if (id->data)
+        kmfree(id->data);
+    kmfree(id);
     return 0;
 }
 
@@ -11,3 +11,4 @@ int64_t ramfs_write(vfs_inode_t* this, size_t offset, size_t len, const void* bu
 int64_t ramfs_sync(vfs_inode_t* this);
 int64_t ramfs_refresh(vfs_inode_t* this);
 int64_t ramfs_setlink(vfs_tnode_t* this, vfs_inode_t* target);
+int64_t ramfs_release(vfs_inode_t* this);
@@ -35,13 +35,60 @@ vfs_inode_t* vfs_alloc_inode(vfs_node_type_t type, uint32_t perms, uint32_t uid,
     return inode;
 }
 
-// frees a tnode, and the inode if needed
-void vfs_free_nodes(vfs_tnode_t* tnode)
+// drops a reference to an inode, freeing it if that was the last one.
+// lookups may still be looking at it, so the memory is only reclaimed
+// after a grace period
+void vfs_inode_put(vfs_inode_t* inode)
 {
-    vfs_inode_t* inode = tnode->inode;
-    if (inode->refcount <= 0)
-        kmfree(inode);
-    kmfree(tnode);
+    // vfs_open() never takes a reference once the count is 0
+    if (__atomic_sub_fetch(&(inode->refcount), 1, __ATOMIC_ACQ_REL))
+        return;
+
+    if (inode->fs && inode->fs->release)
+        inode->fs->release(inode);
+    if (inode->child)
+        kmfree_rcu(inode->child);
+    kmfree_rcu(inode);
+}
+
+size_t vfs_num_children(vfs_inode_t* inode)
+{
+    vfs_childlist_t* list = rcu_dereference(inode->child);
+    return list ? list->len : 0;
+}
+
+// publishes a new child list for parent, with child added at the end
+void vfs_add_child(vfs_inode_t* parent, vfs_tnode_t* child)
+{
+    vfs_childlist_t* old = parent->child;
+    size_t len = old ? old->len : 0;
+
+    vfs_childlist_t* new = kmalloc(sizeof(vfs_childlist_t) + (len + 1) * sizeof(vfs_tnode_t*));
+    if (old)
+        memcpy(old->data, new->data, len * sizeof(vfs_tnode_t*));
+    new->data[len] = child;
+    new->len = len + 1;
+
+    rcu_assign_pointer(parent->child, new);
+    if (old)
+        kmfree_rcu(old);
+}
+
+// publishes a new child list for parent, with child removed
+void vfs_remove_child(vfs_inode_t* parent, vfs_tnode_t* child)
+{
+    vfs_childlist_t* old = parent->child;
+    if (!old)
+        return;
+
+    vfs_childlist_t* new = kmalloc(sizeof(vfs_childlist_t) + old->len * sizeof(vfs_tnode_t*));
+    new->len = 0;
+    for (size_t i = 0; i < old->len; i++)
+        if (old->data[i] != child)
+            new->data[new->len++] = old->data[i];
+
+    rcu_assign_pointer(parent->child, new);
+    kmfree_rcu(old);
 }
 
 // returns the node descriptor for a handle
@@ -55,10 +102,12 @@ vfs_node_desc_t* handle_to_fd(vfs_handle_t handle)
     return curr->openfiles.data[handle];
 }
 
-// converts a path to a node, creates the node if required
+// converts a path to a node, creates the node if required.
+// callers must hold the vfs lock for writing when creating nodes,
+// plain lookups only need rcu_read_lock()
 vfs_tnode_t* path_to_node(char* path, uint8_t mode, vfs_node_type_t create_type)
 {
-    static char tmpbuff[VFS_MAX_PATH_LEN];
+    char tmpbuff[VFS_MAX_NAME_LEN];
     vfs_tnode_t* curr = &vfs_root;
 
     // we only work with absolute paths
@@ -76,6 +125,10 @@ vfs_tnode_t* path_to_node(char* path, uint8_t mode, vfs_node_type_t create_type)
         for (i = 0; curr_index + i < pathlen; i++) {
             if (path[curr_index + i] == '/')
                 break;
+            if (i == VFS_MAX_NAME_LEN - 1) {
+                klog_err("name too long in '%s'\n", path);
+                return NULL;
+            }
             tmpbuff[i] = path[curr_index + i];
         }
         tmpbuff[i] = '\0';
@@ -83,10 +136,12 @@ vfs_tnode_t* path_to_node(char* path, uint8_t mode, vfs_node_type_t create_type)
 
         // search for token in children of current node
         foundnode = false;
-        if (!IS_TRAVERSABLE(curr->inode))
+        vfs_inode_t* inode = rcu_dereference(curr->inode);
+        if (!IS_TRAVERSABLE(inode))
             break;
-        for (size_t i = 0; i < curr->inode->child.len; i++) {
-            vfs_tnode_t* child = vec_at(&(curr->inode->child), i);
+        vfs_childlist_t* children = rcu_dereference(inode->child);
+        for (size_t i = 0; children && i < children->len; i++) {
+            vfs_tnode_t* child = children->data[i];
             if (strncmp(child->name, tmpbuff, sizeof(child->name)) == 0) {
                 foundnode = true;
                 curr = child;
@@ -109,8 +164,9 @@ vfs_tnode_t* path_to_node(char* path, uint8_t mode, vfs_node_type_t create_type)
             vfs_inode_t* new_inode = vfs_alloc_inode(create_type, 0777, 0, curr->inode->fs, curr->inode->mountpoint);
             vfs_tnode_t* new_tnode = vfs_alloc_tnode(tmpbuff, new_inode, curr->inode);
 
-            vec_push_back(&(curr->inode->child), new_tnode);
+            // only make it visible once it is set up
             curr->inode->fs->mknode(new_tnode);
+            vfs_add_child(curr->inode, new_tnode);
             return new_tnode;
         } else {
             klog_err("'%s' doesn't exist\n", path);
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "lock.h"
+#include "proc/acct.h"
+#include "rcu.h"
+#include "rwsem.h"
 #include "proc/sched/sched.h"
 #include "vfs.h"
 
@@ -11,11 +14,14 @@
 #define CREATE 0b0010U
 #define ERR_ON_EXIST 0b0100U
 
-extern lock_t vfs_lock;
+extern rwsem_t vfs_lock;
 extern vfs_tnode_t vfs_root;
 
 vfs_tnode_t* vfs_alloc_tnode(char* name, vfs_inode_t* inode, vfs_inode_t* parent);
 vfs_inode_t* vfs_alloc_inode(vfs_node_type_t type, uint32_t perms, uint32_t uid, vfs_fsinfo_t* fs, vfs_tnode_t* mnt);
-void vfs_free_nodes(vfs_tnode_t* tnode);
+void vfs_inode_put(vfs_inode_t* inode);
+size_t vfs_num_children(vfs_inode_t* inode);
+void vfs_add_child(vfs_inode_t* parent, vfs_tnode_t* child);
+void vfs_remove_child(vfs_inode_t* parent, vfs_tnode_t* child);
 vfs_node_desc_t* handle_to_fd(vfs_handle_t handle);
 vfs_tnode_t* path_to_node(char* path, uint8_t mode, vfs_node_type_t create_type);
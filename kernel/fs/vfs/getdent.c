@@ -10,7 +10,7 @@ int64_t vfs_getdent(vfs_handle_t handle, vfs_dirent_t* dirent) {
     if (!fd)
         return -1;
 
-    lock_wait(&vfs_lock);
+    rwsem_read_lock(&vfs_lock);
 
     // can only traverse folders
     if (!IS_TRAVERSABLE(fd->inode)) {
@@ -20,13 +20,14 @@ int64_t vfs_getdent(vfs_handle_t handle, vfs_dirent_t* dirent) {
     }
 
     // we've reached the end
-    if (fd->seek_pos >= fd->inode->child.len) {
+    vfs_childlist_t* children = fd->inode->child;
+    if (!children || fd->seek_pos >= children->len) {
         status = 0;
         goto done;
     }
 
     // initialize the dirent
-    vfs_tnode_t* entry = vec_at(&(fd->inode->child), fd->seek_pos);
+    vfs_tnode_t* entry = children->data[fd->seek_pos];
     dirent->type = entry->inode->type;
     memcpy(entry->name, dirent->name, sizeof(entry->name));
 
@@ -35,6 +36,6 @@ int64_t vfs_getdent(vfs_handle_t handle, vfs_dirent_t* dirent) {
     fd->seek_pos++;
 
 done:
-    lock_release(&vfs_lock);
+    rwsem_read_unlock(&vfs_lock);
     return status;
 }
\ No newline at end of file
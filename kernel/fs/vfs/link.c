@@ -6,7 +6,7 @@
 
 int64_t vfs_link(char* oldpath, char* newpath)
 {
-    lock_wait(&vfs_lock);
+    rwsem_write_lock(&vfs_lock);
 
     // get the old node
     vfs_tnode_t* old_tnode = path_to_node(oldpath, NO_CREATE, 0);
@@ -24,52 +24,54 @@ int64_t vfs_link(char* oldpath, char* newpath)
     if (new_inode->mountpoint != old_inode->mountpoint) {
         klog_err("mountpoints do not match\n");
         new_inode->fs->setlink(new_tnode, NULL);
-        vfs_free_nodes(new_tnode);
+        vfs_remove_child(new_tnode->parent, new_tnode);
+        vfs_inode_put(new_inode);
+        kmfree_rcu(new_tnode);
         goto fail;
     }
 
-    // link the two nodes
-    old_inode->refcount++;
-    new_inode->refcount = 0;
+    // link the two nodes, old_inode is reachable so it can't be freed
+    __atomic_add_fetch(&(old_inode->refcount), 1, __ATOMIC_RELAXED);
     old_inode->fs->setlink(new_tnode, old_inode);
-    new_tnode->inode = old_inode;
+    rcu_assign_pointer(new_tnode->inode, old_inode);
 
-    // free the new inode
-    kmfree(new_inode);
+    // drop the new inode, unless someone opened it in the meantime
+    vfs_inode_put(new_inode);
 
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return 0;
 fail:
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return -1;
 }
 
 int64_t vfs_unlink(char* path)
 {
-    lock_wait(&vfs_lock);
+    rwsem_write_lock(&vfs_lock);
     vfs_tnode_t* tnode = path_to_node(path, NO_CREATE, 0);
     if (!tnode)
         goto fail;
 
-    if (tnode->inode->child.len != 0) {
+    if (vfs_num_children(tnode->inode) != 0) {
         klog_err("target not an empty folder\n");
         goto fail;
     }
 
-    // decrease refcount and unlink
-    tnode->inode->refcount--;
-    int64_t status = tnode->inode->fs->setlink(tnode, NULL);
+    // unlink
+    vfs_inode_t* inode = tnode->inode;
+    int64_t status = inode->fs->setlink(tnode, NULL);
 
     // remove the tnode from the parent
     vfs_inode_t* parent = tnode->parent;
-    vec_erase_val(&(parent->child), tnode);
+    vfs_remove_child(parent, tnode);
 
-    // free the node data
-    vfs_free_nodes(tnode);
+    // drop its reference, open handles may still keep the inode around
+    vfs_inode_put(inode);
+    kmfree_rcu(tnode);
 
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return status;
 fail:
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return -1;
 }
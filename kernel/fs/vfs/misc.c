@@ -7,13 +7,13 @@
 int64_t vfs_create(char* path, vfs_node_type_t type)
 {
     int64_t status = 0;
-    lock_wait(&vfs_lock);
+    rwsem_write_lock(&vfs_lock);
 
     vfs_tnode_t* node = path_to_node(path, CREATE | ERR_ON_EXIST, type);
     if (!node)
         status = -1;
 
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return status;
 }
 
@@ -39,7 +39,7 @@ int64_t vfs_chmod(vfs_handle_t handle, int32_t newperms)
 // mounts a block device with specified filesystem at a path
 int64_t vfs_mount(char* device, char* path, char* fsname)
 {
-    lock_wait(&vfs_lock);
+    rwsem_write_lock(&vfs_lock);
 
     // get the fs info
     vfs_fsinfo_t* fs = vfs_get_fs(fsname);
@@ -62,20 +62,22 @@ int64_t vfs_mount(char* device, char* path, char* fsname)
     vfs_tnode_t* at = path_to_node(path, NO_CREATE, 0);
     if (!at)
         goto fail;
-    if (at->inode->type != VFS_NODE_FOLDER || at->inode->child.len != 0) {
+    if (at->inode->type != VFS_NODE_FOLDER || vfs_num_children(at->inode) != 0) {
         klog_err("'%s' is not an empty folder\n", path);
         goto fail;
     }
-    kmfree(at->inode);
 
     // mount the fs
-    at->inode = fs->mount(dev ? dev->inode : NULL);
-    at->inode->mountpoint = at;
+    vfs_inode_t* old = at->inode;
+    vfs_inode_t* mnt = fs->mount(dev ? dev->inode : NULL);
+    mnt->mountpoint = at;
+    rcu_assign_pointer(at->inode, mnt);
+    kmfree_rcu(old);
 
     klog_info("mounted %s at %s as %s\n", device ? device : "<no-device>", path, fsname);
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return 0;
 fail:
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
     return -1;
 }
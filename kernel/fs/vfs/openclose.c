@@ -6,37 +6,47 @@
 // open a node and return a handle to it
 vfs_handle_t vfs_open(char* path, vfs_openmode_t mode)
 {
-    lock_wait(&vfs_lock);
+    // the lookup is lock-free, rcu keeps the nodes around while we look
+    rcu_read_lock();
 
     // find the node
     vfs_tnode_t* req = path_to_node(path, NO_CREATE, 0);
     if (!req)
         goto fail;
-    req->inode->refcount++;
+
+    // take a reference, unless the node is being unlinked
+    vfs_inode_t* inode = rcu_dereference(req->inode);
+    uint32_t refs = __atomic_load_n(&(inode->refcount), __ATOMIC_RELAXED);
+    do {
+        if (refs == 0)
+            goto fail;
+    } while (!__atomic_compare_exchange_n(&(inode->refcount), &refs, refs + 1, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    rcu_read_unlock();
 
     // create node descriptor
     vfs_node_desc_t* nd = (vfs_node_desc_t*)kmalloc(sizeof(vfs_node_desc_t));
     nd->tnode = req;
-    nd->inode = req->inode;
+    nd->inode = inode;
     nd->seek_pos = 0;
     nd->mode = mode;
 
     // add to current task
     task_t* curr = sched_get_current();
     vec_push_back(&(curr->openfiles), nd);
+    curr->acct.nr_handles++;
 
     // return the handle
-    lock_release(&vfs_lock);
     return ((vfs_handle_t)(curr->openfiles.len - 1));
 fail:
-    lock_release(&vfs_lock);
+    rcu_read_unlock();
     return -1;
 }
 
 // close a node, given its handle
 int64_t vfs_close(vfs_handle_t handle)
 {
-    lock_wait(&vfs_lock);
+    rwsem_read_lock(&vfs_lock);
 
     // get current task
     task_t* curr = sched_get_current();
@@ -46,14 +56,15 @@ int64_t vfs_close(vfs_handle_t handle)
     if (!fd)
         goto fail;
 
-    // ...and free it
-    fd->inode->refcount--;
+    // ...and free it, along with the inode if it was unlinked meanwhile
+    vfs_inode_put(fd->inode);
     kmfree(fd);
     curr->openfiles.data[handle] = NULL;
+    curr->acct.nr_handles--;
 
-    lock_release(&vfs_lock);
+    rwsem_read_unlock(&vfs_lock);
     return 0;
 fail:
-    lock_release(&vfs_lock);
+    rwsem_read_unlock(&vfs_lock);
     return -1;
 }
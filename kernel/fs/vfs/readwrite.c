@@ -11,7 +11,7 @@ int64_t vfs_read(vfs_handle_t handle, size_t len, void* buff)
     if (!fd)
         return 0;
 
-    lock_wait(&vfs_lock);
+    rwsem_read_lock(&vfs_lock);
     vfs_inode_t* inode = fd->inode;
 
     // truncate if asking for more data than available
@@ -26,7 +26,8 @@ int64_t vfs_read(vfs_handle_t handle, size_t len, void* buff)
         len = 0;
 
 end:
-    lock_release(&vfs_lock);
+    rwsem_read_unlock(&vfs_lock);
+    acct_add(bytes_read, len);
     return (int64_t)len;
 }
 
@@ -43,7 +44,7 @@ int64_t vfs_write(vfs_handle_t handle, size_t len, const void* buff)
         return 0;
     }
 
-    lock_wait(&vfs_lock);
+    rwsem_write_lock(&vfs_lock);
     vfs_inode_t* inode = fd->inode;
 
     // expand file if writing more data than its size
@@ -56,7 +57,8 @@ int64_t vfs_write(vfs_handle_t handle, size_t len, const void* buff)
     if (status == -1)
         len = 0;
 
-    lock_release(&vfs_lock);
+    rwsem_write_unlock(&vfs_lock);
+    acct_add(bytes_written, len);
     return (int64_t)len;
 }
 
@@ -7,14 +7,20 @@
 #include "memutils.h"
 #include "vector.h"
 
-// vfs-wide lock
-lock_t vfs_lock;
+// vfs-wide lock, guards the node tree
+rwsem_t vfs_lock;
 
 // the root node
 vfs_tnode_t vfs_root;
 
-// list of installed filesystems
-vec_new_static(vfs_fsinfo_t*, vfs_fslist);
+// list of installed filesystems, replaced as a whole when one is added
+typedef struct {
+    size_t len;
+    vfs_fsinfo_t* data[];
+} vfs_fslist_t;
+
+static vfs_fslist_t* vfs_fslist;
+static lock_t vfs_fslist_lock;
 
 static void dumpnodes_helper(vfs_tnode_t* from, int lvl)
 {
@@ -22,9 +28,10 @@ static void dumpnodes_helper(vfs_tnode_t* from, int lvl)
         klog_putchar(' ');
     klog_printf(" %d: %s -> %x inode, (%d refs)\n", lvl, from->name, from->inode, from->inode->refcount);
 
-    if (IS_TRAVERSABLE(from->inode))
-        for (size_t i = 0; i < from->inode->child.len; i++)
-            dumpnodes_helper(vec_at(&(from->inode->child), i), lvl + 1);
+    vfs_childlist_t* children = from->inode->child;
+    if (IS_TRAVERSABLE(from->inode) && children)
+        for (size_t i = 0; i < children->len; i++)
+            dumpnodes_helper(children->data[i], lvl + 1);
 }
 
 void vfs_debug()
@@ -36,18 +43,40 @@ void vfs_debug()
 
 void vfs_register_fs(vfs_fsinfo_t* fs)
 {
-    vec_push_back(&vfs_fslist, fs);
+    lock_wait(&vfs_fslist_lock);
+    vfs_fslist_t* old = vfs_fslist;
+    size_t len = old ? old->len : 0;
+
+    vfs_fslist_t* new = kmalloc(sizeof(vfs_fslist_t) + (len + 1) * sizeof(vfs_fsinfo_t*));
+    if (old)
+        memcpy(old->data, new->data, len * sizeof(vfs_fsinfo_t*));
+    new->data[len] = fs;
+    new->len = len + 1;
+
+    rcu_assign_pointer(vfs_fslist, new);
+    lock_release(&vfs_fslist_lock);
+
+    if (old)
+        kmfree_rcu(old);
 }
 
 // get fs with specified name
 vfs_fsinfo_t* vfs_get_fs(char* name)
 {
-    for (size_t i = 0; i < vfs_fslist.len; i++)
-        if (strncmp(name, vfs_fslist.data[i]->name, sizeof(((vfs_fsinfo_t) { 0 }).name)) == 0)
-            return vfs_fslist.data[i];
+    vfs_fsinfo_t* fs = NULL;
+    rcu_read_lock();
+    vfs_fslist_t* list = rcu_dereference(vfs_fslist);
+    for (size_t i = 0; list && i < list->len; i++) {
+        if (strncmp(name, list->data[i]->name, sizeof(((vfs_fsinfo_t) { 0 }).name)) == 0) {
+            fs = list->data[i];
+            break;
+        }
+    }
+    rcu_read_unlock();
 
-    klog_err("filesystem %s not found\n", name);
-    return NULL;
+    if (!fs)
+        klog_err("filesystem %s not found\n", name);
+    return fs;
 }
 
 void vfs_init()
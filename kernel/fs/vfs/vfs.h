@@ -45,9 +45,17 @@ typedef struct vfs_fsinfo_t {
     int64_t (*sync)(vfs_inode_t* this);
     int64_t (*refresh)(vfs_inode_t* this);
     int64_t (*setlink)(vfs_tnode_t* this, vfs_inode_t* target);
+    int64_t (*release)(vfs_inode_t* this); // the last reference is gone
     int64_t (*ioctl)(vfs_inode_t* this, int64_t req_param, void* req_data);
 } vfs_fsinfo_t;
 
+// children of a folder. the list is replaced as a whole on every change,
+// so that lookups can walk it under rcu_read_lock()
+typedef struct {
+    size_t len;
+    vfs_tnode_t* data[];
+} vfs_childlist_t;
+
 struct _vfs_tnode_t {
     char name[VFS_MAX_NAME_LEN];
     vfs_inode_t* inode;
@@ -64,7 +72,7 @@ struct _vfs_inode_t {
     vfs_fsinfo_t* fs;
     void* ident;
     vfs_tnode_t* mountpoint;
-    vec_struct(vfs_tnode_t*) child;
+    vfs_childlist_t* child; // NULL if there are no children
 };
 
 // structure describing an open node
@@ -3,12 +3,20 @@
 #include "dev/term/term.h"
 #include "fs/vfs/vfs.h"
 #include "klog.h"
+#include "lockstat.h"
 #include "mm/mm.h"
+#include "proc/acct.h"
+#include "proc/sched/idle.h"
+#include "proc/sched/parallel.h"
 #include "proc/sched/sched.h"
+#include "proc/sched/schedstat.h"
+#include "proc/sched/workqueue.h"
 #include "random.h"
+#include "rcu.h"
 #include "sys/acpi/acpi.h"
 #include "sys/apic/apic.h"
 #include "sys/cpu/cpu.h"
+#include "sys/cpu/fpu.h"
 #include "sys/gdt.h"
 #include "sys/hpet.h"
 #include "sys/idt.h"
@@ -21,8 +29,28 @@ _Noreturn void kinit(tid_t tid)
 {
     (void)tid;
     klog_show();
+    rcu_init();
+    workqueue_init();
+    parallel_init();
+    acct_init();
     klog_ok("first kernel task started\n");
     pmm_dumpstats();
+    kstack_dumpstats();
+    lockstat_dump();
+    smp_percpu_benchmark();
+    lock_benchmark();
+    sched_benchmark();
+    sched_rt_benchmark();
+    sched_sleep_benchmark();
+    sched_idle_selftest();
+    sched_wake_selftest();
+    parallel_benchmark();
+    task_benchmark();
+    sched_dumpstats();
+    idle_dumpstats();
+    workqueue_dumpstats();
+    fpu_dumpstats();
+    acct_dumpstats();
     kernel_panic("This OS is a work in progress\n");
     while (true)
         ;
@@ -45,7 +73,13 @@ _Noreturn void kmain(stivale2_struct* bootinfo)
     idt_init();
     cpu_features_init();
 
-    // system initialization
+    // fpu=eager on the command line restores state on every switch
+    stv2_struct_tag_cmdline* cmdline = stv2_find_struct_tag(bootinfo, STIVALE2_STRUCT_TAG_CMDLINE_ID);
+    fpu_init(cmdline ? (const char*)PHYS_TO_VIRT(cmdline->cmdline) : NULL);
+
+    // system initialization, per-cpu variables are read from the boot
+    // copy until smp_init(), and allocations are charged to the current task
+    smp_early_init();
     pmm_init((stv2_struct_tag_mmap*)stv2_find_struct_tag(bootinfo, STV2_STRUCT_TAG_MMAP_ID));
     vmm_init();
     gdt_init();
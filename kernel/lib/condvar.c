@@ -0,0 +1,29 @@
+#include "condvar.h"
+
+/*
+ * The waiter gets on the queue before letting go of the mutex, and the
+ * condition can only change with the mutex held, so a signal sent after
+ * the change always finds the waiter on the queue.
+ */
+void condvar_wait(condvar_t* cv, mutex_t* m)
+{
+    lock_wait(&cv->wq.lock);
+    mutex_unlock(m);
+    waitq_sleep(&cv->wq);
+    lock_release(&cv->wq.lock);
+    mutex_lock(m);
+}
+
+void condvar_signal(condvar_t* cv)
+{
+    lock_wait(&cv->wq.lock);
+    waitq_wake_one(&cv->wq);
+    lock_release(&cv->wq.lock);
+}
+
+void condvar_broadcast(condvar_t* cv)
+{
+    lock_wait(&cv->wq.lock);
+    waitq_wake_all(&cv->wq);
+    lock_release(&cv->wq.lock);
+}
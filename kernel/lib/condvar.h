@@ -0,0 +1,13 @@
+#pragma once
+
+#include "mutex.h"
+#include "proc/sched/waitq.h"
+
+// a condition variable, always used together with a mutex
+typedef struct {
+    waitq_t wq;
+} condvar_t;
+
+void condvar_wait(condvar_t* cv, mutex_t* m);
+void condvar_signal(condvar_t* cv);
+void condvar_broadcast(condvar_t* cv);
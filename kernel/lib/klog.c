@@ -5,6 +5,7 @@
 #include "proc/task.h"
 #include "sys/hpet.h"
 #include "proc/sched/sched.h"
+#include "proc/sched/workqueue.h"
 #include <stdbool.h>
 
 // ring buffer for kernel log
@@ -15,12 +16,73 @@ static uint16_t log_end = 0;
 // lock to prevent concurrent modification
 static lock_t log_lock;
 
+// how far the serial port has caught up with the log. only one cpu sends
+// at a time, the others leave their output to it
+static uint16_t serial_pos = 0;
+static lock_t serial_lock;
+
 static void putch(uint8_t i)
 {
     log_buff[log_end++] = i;
     if (log_end == log_start)
         log_start++;
-    serial_send((char)i);
+}
+
+// sends whatever has not been sent yet, without holding the log meanwhile
+static void serial_drain()
+{
+    static uint8_t chunk[KLOG_SERIAL_CHUNK];
+    while (true) {
+        if (!lock_try(&serial_lock))
+            return;
+        while (true) {
+            lock_wait(&log_lock);
+
+            // the log wrapped around past what we had not sent yet
+            if ((uint16_t)(serial_pos - log_start) > (uint16_t)(log_end - log_start))
+                serial_pos = log_start;
+            uint32_t n = 0;
+            while (serial_pos != log_end && n < KLOG_SERIAL_CHUNK)
+                chunk[n++] = log_buff[serial_pos++];
+            lock_release(&log_lock);
+
+            if (!n)
+                break;
+            for (uint32_t i = 0; i < n; i++)
+                serial_send((char)chunk[i]);
+        }
+        lock_release_try(&serial_lock);
+
+        // someone may have logged something after we last looked, and
+        // left it to us since we still held the serial port
+        lock_wait(&log_lock);
+        bool more = serial_pos != log_end;
+        lock_release(&log_lock);
+        if (!more)
+            return;
+    }
+}
+
+static void serial_work_fn(work_t* w)
+{
+    (void)w;
+    serial_drain();
+}
+
+static work_t serial_work = { .func = serial_work_fn };
+
+// releases the log, and has what was written sent to the serial port
+static void log_unlock()
+{
+    // with interrupts disabled we may be inside the scheduler, or
+    // panicking, so the caller sends it itself
+    bool deferrable = log_lock.rflags & (1 << 9);
+    lock_release(&log_lock);
+
+    if (deferrable && workqueue_online())
+        work_queue(&serial_work);
+    else
+        serial_drain();
 }
 
 static void putsn(const char* s, uint64_t len)
@@ -67,7 +129,8 @@ static void putint(int n)
     }
 }
 
-static void klog_show_helper()
+// number of characters at the end of the log which fit on screen
+static uint32_t count_visible()
 {
     // maximum no of chars that can fit on screen
     uint32_t width = term_getwidth(), height = term_getheight(),
@@ -85,6 +148,12 @@ static void klog_show_helper()
         else if(log_buff[i])
             used += 1;
     }
+    return visible;
+}
+
+static void klog_show_helper()
+{
+    uint32_t visible = count_visible();
 
     // now print the characters
     for (uint16_t i = log_end - visible; i != log_end; i++)
@@ -94,13 +163,21 @@ static void klog_show_helper()
 _Noreturn static void klogdisplayd(tid_t tid)
 {
     (void)tid;
+    static uint8_t snapshot[KLOG_BUFF_LEN];
 
     while (true) {
         timeval_t begin = hpet_get_nanos();
-        term_clear();
+
+        // copy out the visible part, so the log isn't locked while we render
         lock_wait(&log_lock);
-        klog_show_helper();
+        uint32_t visible = count_visible();
+        for (uint32_t i = 0; i < visible; i++)
+            snapshot[i] = log_buff[(uint16_t)(log_end - visible + i)];
         lock_release(&log_lock);
+
+        term_clear();
+        for (uint32_t i = 0; i < visible; i++)
+            term_putchar(snapshot[i]);
         term_flush();
         timeval_t end = hpet_get_nanos(), delta = end - begin;
 
@@ -150,28 +227,28 @@ void klog_putchar(uint8_t i)
 {
     lock_wait(&log_lock);
     putch(i);
-    lock_release(&log_lock);
+    log_unlock();
 }
 
 void klog_puts(const char* s)
 {
     lock_wait(&log_lock);
     puts(s);
-    lock_release(&log_lock);
+    log_unlock();
 }
 
 void klog_putsn(const char* s, uint64_t len)
 {
     lock_wait(&log_lock);
     putsn(s, len);
-    lock_release(&log_lock);
+    log_unlock();
 }
 
 void klog_vprintf(const char* s, va_list args)
 {
     lock_wait(&log_lock);
     vprintf(s, args);
-    lock_release(&log_lock);
+    log_unlock();
 }
 
 void klog_printf(const char* s, ...)
@@ -181,7 +258,7 @@ void klog_printf(const char* s, ...)
     va_start(args, s);
     vprintf(s, args);
     va_end(args);
-    lock_release(&log_lock);
+    log_unlock();
 }
 
 void klog(loglevel_t lvl, const char* s, ...)
@@ -205,17 +282,24 @@ void klog(loglevel_t lvl, const char* s, ...)
     va_start(args, s);
     vprintf(s, args);
     va_end(args);
-    lock_release(&log_lock);
+    log_unlock();
 }
 
 void klog_show()
 {
-    task_add(klogdisplayd, PRIORITY_MAX, TASK_KERNEL_MODE, NULL, 0);
+    // pinned to this cpu, so it always finds the log in its cache
+    task_t* t = task_make(klogdisplayd, PRIORITY_MAX, TASK_KERNEL_MODE, NULL, 0);
+    if (!t)
+        return;
+    cpumask_zero(&(t->affinity));
+    cpumask_set(&(t->affinity), smp_get_current_info()->cpu_id);
+    sched_add(t);
 }
 
 // shows the log immediately
 void klog_show_now()
 {
+    serial_drain();
     term_clear();
     klog_show_helper();
     term_flush();
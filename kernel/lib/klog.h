@@ -6,6 +6,9 @@
 
 #define KLOG_BUFF_LEN (UINT16_MAX + 1)
 
+// bytes copied out of the log at a time for the serial port
+#define KLOG_SERIAL_CHUNK 256
+
 typedef enum {
     LOG_SUCCESS,
     LOG_INFO,
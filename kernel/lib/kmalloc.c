@@ -6,11 +6,13 @@
 #include "memutils.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
+#include "rcu.h"
 #include "stddef.h"
 
 struct metadata {
     size_t numpages;
     size_t size;
+    rcu_head_t rcu; // used by kmfree_rcu()
 };
 
 void* kmalloc(uint64_t size)
@@ -27,6 +29,19 @@ void kmfree(void* addr)
     pmm_free(VIRT_TO_PHYS(d), d->numpages + 1);
 }
 
+static void kmfree_rcu_callback(rcu_head_t* head)
+{
+    struct metadata* d = (struct metadata*)((uint8_t*)head - offsetof(struct metadata, rcu));
+    kmfree((uint8_t*)d + PAGE_SIZE);
+}
+
+// frees memory once no rcu reader can be using it anymore
+void kmfree_rcu(void* addr)
+{
+    struct metadata* d = (struct metadata*)((uint8_t*)addr - PAGE_SIZE);
+    call_rcu(&d->rcu, kmfree_rcu_callback);
+}
+
 void* kmrealloc(void* addr, size_t newsize)
 {
     if (!addr)
@@ -5,4 +5,5 @@
 
 void* kmalloc(uint64_t size);
 void kmfree(void* addr);
+void kmfree_rcu(void* addr);
 void* kmrealloc(void* addr, size_t newsize);
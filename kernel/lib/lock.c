@@ -1,36 +1,151 @@
 #include "lock.h"
+#include "klog.h"
+#include "proc/sched/sched.h"
+#include "semaphore.h"
+#include "sys/hpet.h"
 #include <stdbool.h>
 
 bool rwlock_try_read(rwlock_t* l)
 {
-    lock_wait(&(l->nrlock));
-    l->num_readers++;
-    if (l->num_readers == 1) {
-        if (!lock_try(&(l->wlock))) {
-            l->num_readers--;
-            lock_release(&(l->nrlock));
-            return false;
-        };
+    // give way to waiting writers
+    if (__atomic_load_n(&l->writers_waiting, __ATOMIC_RELAXED))
+        return false;
+
+    uint32_t old = __atomic_fetch_add(&l->state, 1, __ATOMIC_ACQUIRE);
+    if (old & RWLOCK_WRITER) {
+        __atomic_fetch_sub(&l->state, 1, __ATOMIC_RELAXED);
+        return false;
     }
-    lock_release(&(l->nrlock));
     return true;
 }
 
 void rwlock_end_read(rwlock_t* l)
 {
-    lock_wait(&(l->nrlock));
-    l->num_readers--;
-    if (l->num_readers == 0)
-        lock_release(&(l->wlock));
-    lock_release(&(l->nrlock));
+    __atomic_fetch_sub(&l->state, 1, __ATOMIC_RELEASE);
 }
 
 bool rwlock_try_write(rwlock_t* l)
 {
-    return lock_try(&(l->wlock));
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&l->state, &expected, RWLOCK_WRITER, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 void rwlock_end_write(rwlock_t* l)
 {
-    lock_release(&(l->wlock));
+    __atomic_fetch_and(&l->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+uint64_t rwlock_read_lock(rwlock_t* l)
+{
+    uint64_t rflags = lock_irq_save();
+    while (!rwlock_try_read(l)) {
+        // wait until it looks free before trying again
+        while (__atomic_load_n(&l->writers_waiting, __ATOMIC_RELAXED)
+            || (__atomic_load_n(&l->state, __ATOMIC_RELAXED) & RWLOCK_WRITER))
+            asm volatile("pause");
+    }
+    return rflags;
+}
+
+void rwlock_read_unlock(rwlock_t* l, uint64_t rflags)
+{
+    rwlock_end_read(l);
+    lock_irq_restore(rflags);
+}
+
+void rwlock_write_lock(rwlock_t* l)
+{
+    uint64_t rflags = lock_irq_save();
+    __atomic_fetch_add(&l->writers_waiting, 1, __ATOMIC_RELAXED);
+    while (!rwlock_try_write(l)) {
+        while (__atomic_load_n(&l->state, __ATOMIC_RELAXED))
+            asm volatile("pause");
+    }
+    __atomic_fetch_sub(&l->writers_waiting, 1, __ATOMIC_RELAXED);
+    l->rflags = rflags;
+}
+
+void rwlock_write_unlock(rwlock_t* l)
+{
+    uint64_t rflags = l->rflags;
+    rwlock_end_write(l);
+    lock_irq_restore(rflags);
+}
+
+// acquisitions made by one lock_benchmark() task, on a line of its own
+typedef struct {
+    uint64_t count;
+} __attribute__((aligned(64))) lock_bench_t;
+
+static lock_t bench_lock;
+static lock_bench_t bench_counts[CPU_MAX];
+static uint32_t bench_ready;
+static bool bench_go;
+static bool bench_stop;
+static semaphore_t bench_done;
+
+// takes and releases the lock as fast as it can, until told to stop
+static void lock_hammer(tid_t tid)
+{
+    (void)tid;
+    lock_bench_t* b = &bench_counts[smp_get_current_info()->cpu_id];
+    __atomic_add_fetch(&bench_ready, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&bench_go, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+        lock_wait(&bench_lock);
+        b->count++;
+        lock_release(&bench_lock);
+    }
+
+    sem_post(&bench_done);
+    sched_die();
+}
+
+/*
+ * A task on every cpu hammers the same lock for a while. The total rate
+ * is logged, along with the largest and smallest share one task got,
+ * which a fair lock keeps close to an even split.
+ */
+void lock_benchmark()
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    bench_ready = 0;
+    bench_go = bench_stop = false;
+    sem_init(&bench_done, 0);
+    for (uint16_t i = 0; i < ncpus; i++) {
+        bench_counts[i].count = 0;
+        task_t* t = task_make(lock_hammer, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+        if (!t)
+            return;
+        cpumask_zero(&(t->affinity));
+        cpumask_set(&(t->affinity), i);
+        sched_add(t);
+    }
+    while (__atomic_load_n(&bench_ready, __ATOMIC_SEQ_CST) < ncpus)
+        sched_yield();
+
+    timeval_t start = hpet_get_nanos();
+    __atomic_store_n(&bench_go, true, __ATOMIC_RELEASE);
+    sched_sleep(LOCK_BENCH_TIME);
+    __atomic_store_n(&bench_stop, true, __ATOMIC_RELAXED);
+    timeval_t t = hpet_get_nanos() - start;
+    for (uint16_t i = 0; i < ncpus; i++)
+        sem_wait(&bench_done);
+
+    uint64_t total = 0, max = 0, min = UINT64_MAX;
+    for (uint16_t i = 0; i < ncpus; i++) {
+        uint64_t c = bench_counts[i].count;
+        total += c;
+        max = c > max ? c : max;
+        min = c < min ? c : min;
+    }
+    klog_info("lock contention on %d cpus: %d acquisitions/s\n", ncpus,
+        t ? total * SECONDS_TO_NANOS(1) / t : 0);
+    klog_printf(" \t \tshare per task: max %d.%d%%, min %d.%d%%, even %d.%d%%\n\n",
+        total ? max * 100 / total : 0, total ? max * 1000 / total % 10 : 0,
+        total ? min * 100 / total : 0, total ? min * 1000 / total % 10 : 0,
+        100 / ncpus, 1000 / ncpus % 10);
 }
@@ -1,52 +1,166 @@
 #pragma once
 
+#include "time.h"
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef LOCKSTAT
+#include "lockstat.h"
+#include <stddef.h>
+#endif
+
+// spin iterations per waiter ahead of us in the queue
+#define LOCK_BACKOFF_UNIT 32
+
+// how long the tasks started by lock_benchmark() fight over one lock
+#define LOCK_BENCH_TIME MILLIS_TO_NANOS(200)
+
+/*
+ * A ticket spinlock. Waiters take a ticket with a single atomic add and
+ * wait until the owner field reaches it, so the lock is handed out in
+ * strict FIFO order. While waiting we only read the owner field, backing
+ * off in proportion to our distance from the head of the queue, so the
+ * cache line is not bounced around by locked writes.
+ */
 typedef volatile struct {
-    int lock;
+    union {
+        uint32_t val;
+        struct {
+            uint16_t owner; // ticket currently being served
+            uint16_t next; // next ticket to hand out
+        };
+    };
     uint64_t rflags;
+#ifdef LOCKSTAT
+    lockstat_site_t* site; // where the current holder acquired it
+    uint64_t acquired_at; // tsc value at acquisition
+#endif
 } lock_t;
 
+// set in rwlock_t.state while a writer holds the lock
+#define RWLOCK_WRITER (1U << 31)
+
+/*
+ * A reader-writer spinlock. Readers only do a single atomic add on the
+ * state word, so concurrent readers never serialize on each other.
+ * Waiting writers are counted, and new readers hold off while there are
+ * any, so a steady stream of readers cannot starve a writer.
+ */
 typedef volatile struct {
-    int num_readers;
-    lock_t nrlock;
-    lock_t wlock;
+    uint32_t state; // number of readers, or RWLOCK_WRITER
+    uint32_t writers_waiting;
+    uint64_t rflags;
 } rwlock_t;
 
-#define lock_wait(s)                                            \
-    {                                                           \
-        asm volatile(                                           \
-            "pushfq;"                                           \
-            "cli;"                                              \
-            "lock bts $0, %[lock];"                             \
-            "jnc 2f;"                                           \
-            "1:"                                                \
-            "pause;"                                            \
-            "bt $0, %[lock];"                                   \
-            "jc 1b;"                                            \
-            "lock bts $0, %[lock];"                             \
-            "jc 1b;"                                            \
-            "2:"                                                \
-            "pop %[flags]"                                      \
-            : [lock] "=m"((s)->lock), [flags] "=m"((s)->rflags) \
-            :                                                   \
-            : "memory", "cc");                                  \
+// save rflags and disable interrupts
+static inline uint64_t lock_irq_save()
+{
+    uint64_t flags;
+    asm volatile("pushfq;"
+                 "cli;"
+                 "pop %0"
+                 : "=rm"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+static inline void lock_irq_restore(uint64_t flags)
+{
+    asm volatile("push %0;"
+                 "popfq"
+                 :
+                 : "rm"(flags)
+                 : "memory", "cc");
+}
+
+// returns true if we had to wait for the lock
+static inline bool ticket_acquire(lock_t* s)
+{
+    uint16_t ticket = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+    bool contended = false;
+    while (true) {
+        uint16_t ahead = ticket - __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+        if (!ahead)
+            break;
+        contended = true;
+        for (uint32_t i = 0; i < ahead * LOCK_BACKOFF_UNIT; i++)
+            asm volatile("pause");
     }
+    return contended;
+}
+
+static inline void ticket_release(lock_t* s)
+{
+    __atomic_store_n(&s->owner, s->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline bool ticket_try(lock_t* s)
+{
+    uint32_t old = __atomic_load_n(&s->val, __ATOMIC_RELAXED);
+
+    // someone holds the lock or is queued for it
+    if ((uint16_t)old != (uint16_t)(old >> 16))
+        return false;
+    return __atomic_compare_exchange_n(&s->val, &old, old + (1U << 16), false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+#ifndef LOCKSTAT
 
-#define lock_release(s)                         \
-    {                                           \
-        asm volatile("push %[flags];"           \
-                     "lock btr $0, %[lock];"    \
-                     "popfq;"                   \
-                     : [lock] "=m"((s)->lock)   \
-                     : [flags] "m"((s)->rflags) \
-                     : "memory", "cc");         \
+#define lock_wait(s)                              \
+    {                                             \
+        uint64_t __flags = lock_irq_save();       \
+        ticket_acquire(s);                        \
+        (s)->rflags = __flags;                    \
     }
 
-#define lock_try(s) __sync_bool_compare_and_swap(&((s)->lock), 0, 1)
+#define lock_release(s)                           \
+    {                                             \
+        uint64_t __flags = (s)->rflags;           \
+        ticket_release(s);                        \
+        lock_irq_restore(__flags);                \
+    }
+
+#else
+
+#define lock_wait(s)                                                           \
+    {                                                                          \
+        uint64_t __flags = lock_irq_save();                                    \
+        uint64_t __begin = rdtsc();                                            \
+        bool __contended = ticket_acquire(s);                                  \
+        (s)->rflags = __flags;                                                 \
+        (s)->acquired_at = rdtsc();                                            \
+        (s)->site = lockstat_get_site((void*)(s), __func__, __LINE__);         \
+        lockstat_record_acquire((s)->site, __contended, (s)->acquired_at - __begin); \
+    }
+
+#define lock_release(s)                                                        \
+    {                                                                          \
+        if ((s)->site)                                                         \
+            lockstat_record_hold((s)->site, rdtsc() - (s)->acquired_at);       \
+        (s)->site = NULL;                                                      \
+        uint64_t __flags = (s)->rflags;                                        \
+        ticket_release(s);                                                     \
+        lock_irq_restore(__flags);                                             \
+    }
+
+#endif
+
+// lock_try() leaves the interrupt flag alone, so does this
+#define lock_try(s) ticket_try(s)
+#define lock_release_try(s) ticket_release(s)
 
+// these do not touch the interrupt flag
 bool rwlock_try_read(rwlock_t* l);
 void rwlock_end_read(rwlock_t* l);
 bool rwlock_try_write(rwlock_t* l);
 void rwlock_end_write(rwlock_t* l);
+
+// these spin with interrupts disabled, like lock_wait()
+uint64_t rwlock_read_lock(rwlock_t* l);
+void rwlock_read_unlock(rwlock_t* l, uint64_t rflags);
+void rwlock_write_lock(rwlock_t* l);
+void rwlock_write_unlock(rwlock_t* l);
+
+void lock_benchmark();
@@ -0,0 +1,105 @@
+#ifdef LOCKSTAT
+
+#include "lockstat.h"
+#include "klog.h"
+
+/*
+ * Sites live in an open addressing hash table, keyed by lock address and
+ * call site. Entries are claimed with a compare-and-swap and never freed,
+ * so recording does not need a lock of its own.
+ */
+static lockstat_site_t sites[LOCKSTAT_MAX_SITES];
+
+// acquisitions we could not record since the table was full
+static uint64_t dropped;
+
+static void update_max(uint64_t* max, uint64_t val)
+{
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > old && !__atomic_compare_exchange_n(max, &old, val, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+lockstat_site_t* lockstat_get_site(void* lock, const char* func, int line)
+{
+    uint64_t hash = ((uint64_t)lock ^ ((uint64_t)func << 7) ^ (uint64_t)line) * 0x9e3779b97f4a7c15ULL;
+
+    for (uint64_t i = 0; i < LOCKSTAT_MAX_SITES; i++) {
+        lockstat_site_t* s = &sites[(hash + i) % LOCKSTAT_MAX_SITES];
+        void* owner = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+
+        // try to claim an empty slot
+        if (!owner) {
+            if (__atomic_compare_exchange_n(&s->lock, &owner, lock, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                s->func = func;
+                s->line = line;
+                __atomic_store_n(&s->valid, true, __ATOMIC_RELEASE);
+                return s;
+            }
+        }
+        if (owner != lock)
+            continue;
+
+        // slot belongs to this lock, wait for it to be filled in
+        while (!__atomic_load_n(&s->valid, __ATOMIC_ACQUIRE))
+            asm volatile("pause");
+        if (s->func == func && s->line == line)
+            return s;
+    }
+
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void lockstat_record_acquire(lockstat_site_t* site, bool contended, uint64_t spin)
+{
+    if (!site)
+        return;
+
+    __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+    if (!contended)
+        return;
+    __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->spin_total, spin, __ATOMIC_RELAXED);
+    update_max(&site->spin_max, spin);
+}
+
+void lockstat_record_hold(lockstat_site_t* site, uint64_t hold)
+{
+    __atomic_fetch_add(&site->hold_total, hold, __ATOMIC_RELAXED);
+    update_max(&site->hold_max, hold);
+}
+
+// prints the most contended lock sites
+void lockstat_dump()
+{
+    static bool shown[LOCKSTAT_MAX_SITES];
+    for (int i = 0; i < LOCKSTAT_MAX_SITES; i++)
+        shown[i] = false;
+
+    klog_info("top contended locks (times in tsc cycles)\n");
+    klog_printf(" \t \tlock                site              acq     cont    avg spin  max spin  avg hold  max hold\n");
+    for (int n = 0; n < LOCKSTAT_REPORT_TOP; n++) {
+        // pick the next most contended site
+        int best = -1;
+        for (int i = 0; i < LOCKSTAT_MAX_SITES; i++) {
+            if (!sites[i].valid || shown[i] || !sites[i].contended)
+                continue;
+            if (best < 0 || sites[i].contended > sites[best].contended)
+                best = i;
+        }
+        if (best < 0)
+            break;
+        shown[best] = true;
+
+        lockstat_site_t* s = &sites[best];
+        uint64_t acq = s->acquisitions, cont = s->contended;
+        klog_printf(" \t \t%x %s:%d  %d  %d  %d  %d  %d  %d\n", s->lock, s->func, s->line,
+            acq, cont, s->spin_total / cont, s->spin_max, s->hold_total / acq, s->hold_max);
+    }
+    if (dropped)
+        klog_printf(" \t \t%d acquisitions not recorded, site table full\n", dropped);
+    klog_printf("\n");
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+ * Lock contention statistics. Only compiled in when LOCKSTAT is defined
+ * (see the Makefile), otherwise lock_t carries no extra state and
+ * lockstat_dump() does nothing.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// size of the call site table
+#define LOCKSTAT_MAX_SITES 512
+
+// number of sites shown by lockstat_dump()
+#define LOCKSTAT_REPORT_TOP 10
+
+// statistics for one lock, acquired at one place. times are in tsc cycles
+typedef struct {
+    void* lock;
+    const char* func;
+    int line;
+    bool valid;
+
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spin_total;
+    uint64_t spin_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+} lockstat_site_t;
+
+#ifdef LOCKSTAT
+
+#include "sys/cpu/cpu.h"
+
+lockstat_site_t* lockstat_get_site(void* lock, const char* func, int line);
+void lockstat_record_acquire(lockstat_site_t* site, bool contended, uint64_t spin);
+void lockstat_record_hold(lockstat_site_t* site, uint64_t hold);
+void lockstat_dump();
+
+#else
+
+static inline void lockstat_dump() { }
+
+#endif
@@ -0,0 +1,64 @@
+#include "mutex.h"
+#include "proc/sched/idle.h"
+#include "proc/sched/sched.h"
+#include "rcu.h"
+#include "sys/smp/smp.h"
+
+bool mutex_trylock(mutex_t* m)
+{
+    task_t* expected = NULL;
+    return __atomic_compare_exchange_n(&m->owner, &expected, sched_get_current(), false,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// spin while the owner is running on another cpu, returns true if we got
+// the lock. the owner may exit and be recycled meanwhile, so it is only
+// looked at inside an rcu read-side section, and the janitor waits for a
+// grace period before reusing a task
+static bool mutex_spin(mutex_t* m)
+{
+    for (int i = 0; i < MUTEX_SPIN_MAX; i++) {
+        rcu_read_lock();
+        uint16_t cpu = smp_get_current_info()->cpu_id;
+        task_t* owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+        bool spin = !owner
+            || (((volatile task_t*)owner)->status == TASK_RUNNING
+                && ((volatile task_t*)owner)->last_cpu != cpu);
+        rcu_read_unlock();
+
+        // owner is not on another cpu, it won't release the lock soon.
+        // and if our cpu has other work, let it run instead
+        if (!spin || idle_need_resched(cpu))
+            return false;
+        if (!owner && mutex_trylock(m))
+            return true;
+        asm volatile("pause");
+    }
+    return false;
+}
+
+void mutex_lock(mutex_t* m)
+{
+    if (mutex_trylock(m) || mutex_spin(m))
+        return;
+
+    lock_wait(&m->wq.lock);
+    __atomic_fetch_add(&m->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!mutex_trylock(m))
+        waitq_sleep(&m->wq);
+    __atomic_fetch_sub(&m->waiters, 1, __ATOMIC_RELAXED);
+    lock_release(&m->wq.lock);
+}
+
+void mutex_unlock(mutex_t* m)
+{
+    __atomic_store_n(&m->owner, NULL, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&m->waiters, __ATOMIC_RELAXED))
+        return;
+
+    // wake up exactly one waiter to take over
+    lock_wait(&m->wq.lock);
+    waitq_wake_one(&m->wq);
+    lock_release(&m->wq.lock);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "proc/sched/waitq.h"
+#include "proc/task.h"
+
+// how many times to poll a running owner before going to sleep
+#define MUTEX_SPIN_MAX 4096
+
+/*
+ * A sleeping mutex. While the owner is running on another cpu we spin
+ * for a while, since it will likely release the lock soon. Otherwise the
+ * task sleeps until the owner hands it over. Only usable from tasks.
+ */
+typedef struct {
+    task_t* owner;
+    uint32_t waiters; // number of tasks sleeping on wq
+    waitq_t wq;
+} mutex_t;
+
+void mutex_lock(mutex_t* m);
+bool mutex_trylock(mutex_t* m);
+void mutex_unlock(mutex_t* m);
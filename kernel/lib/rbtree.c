@@ -0,0 +1,229 @@
+#include "rbtree.h"
+
+// makes new take the place of old under parent
+static void replace_child(rbtree_t* t, rb_node_t* parent, rb_node_t* old, rb_node_t* new)
+{
+    if (!parent)
+        t->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rotate_left(rbtree_t* t, rb_node_t* x)
+{
+    rb_node_t* y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    replace_child(t, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(rbtree_t* t, rb_node_t* x)
+{
+    rb_node_t* y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    replace_child(t, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+static inline bool is_red(rb_node_t* n)
+{
+    return n && n->red;
+}
+
+void rb_insert(rbtree_t* t, rb_node_t* node, rb_less_t less)
+{
+    // find where the node goes
+    rb_node_t* parent = NULL;
+    rb_node_t** link = &t->root;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+    if (leftmost)
+        t->leftmost = node;
+
+    // fix red nodes with red parents
+    rb_node_t* p;
+    while ((p = node->parent) && p->red) {
+        rb_node_t* g = p->parent;
+        if (p == g->left) {
+            rb_node_t* u = g->right;
+            if (is_red(u)) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->right) {
+                rotate_left(t, p);
+                node = p;
+                p = node->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rotate_right(t, g);
+        } else {
+            rb_node_t* u = g->left;
+            if (is_red(u)) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->left) {
+                rotate_right(t, p);
+                node = p;
+                p = node->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rotate_left(t, g);
+        }
+    }
+    t->root->red = false;
+}
+
+// puts v in place of u, u's children are left alone
+static void transplant(rbtree_t* t, rb_node_t* u, rb_node_t* v)
+{
+    replace_child(t, u->parent, u, v);
+    if (v)
+        v->parent = u->parent;
+}
+
+// x took the place of a removed black node, and is short of one black
+static void erase_fixup(rbtree_t* t, rb_node_t* x, rb_node_t* xp)
+{
+    while (x != t->root && !is_red(x)) {
+        if (x == xp->left) {
+            rb_node_t* w = xp->right;
+            if (w->red) {
+                w->red = false;
+                xp->red = true;
+                rotate_left(t, xp);
+                w = xp->right;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+            } else {
+                if (!is_red(w->right)) {
+                    w->left->red = false;
+                    w->red = true;
+                    rotate_right(t, w);
+                    w = xp->right;
+                }
+                w->red = xp->red;
+                xp->red = false;
+                w->right->red = false;
+                rotate_left(t, xp);
+                x = t->root;
+            }
+        } else {
+            rb_node_t* w = xp->left;
+            if (w->red) {
+                w->red = false;
+                xp->red = true;
+                rotate_right(t, xp);
+                w = xp->left;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = xp;
+                xp = x->parent;
+            } else {
+                if (!is_red(w->left)) {
+                    w->right->red = false;
+                    w->red = true;
+                    rotate_left(t, w);
+                    w = xp->left;
+                }
+                w->red = xp->red;
+                xp->red = false;
+                w->left->red = false;
+                rotate_right(t, xp);
+                x = t->root;
+            }
+        }
+    }
+    if (x)
+        x->red = false;
+}
+
+void rb_erase(rbtree_t* t, rb_node_t* node)
+{
+    if (t->leftmost == node)
+        t->leftmost = rb_next(node);
+
+    // x moves into the removed position, xp is its new parent
+    rb_node_t *x, *xp;
+    bool removed_red;
+
+    if (!node->left || !node->right) {
+        x = node->left ? node->left : node->right;
+        xp = node->parent;
+        removed_red = node->red;
+        transplant(t, node, x);
+    } else {
+        // replace the node with its successor
+        rb_node_t* y = node->right;
+        while (y->left)
+            y = y->left;
+        removed_red = y->red;
+        x = y->right;
+
+        if (y->parent == node) {
+            xp = y;
+        } else {
+            xp = y->parent;
+            transplant(t, y, y->right);
+            y->right = node->right;
+            y->right->parent = y;
+        }
+        transplant(t, node, y);
+        y->left = node->left;
+        y->left->parent = y;
+        y->red = node->red;
+    }
+
+    if (!removed_red)
+        erase_fixup(t, x, xp);
+}
+
+rb_node_t* rb_next(rb_node_t* node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * An intrusive red-black tree. The node is embedded in the containing
+ * structure, and rb_entry() gets back to it, so inserting and removing
+ * never allocate. The leftmost node is cached for O(1) access.
+ */
+typedef struct rb_node_t {
+    struct rb_node_t* parent;
+    struct rb_node_t* left;
+    struct rb_node_t* right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t* root;
+    rb_node_t* leftmost;
+} rbtree_t;
+
+// orders the nodes, equal nodes go after existing ones
+typedef bool (*rb_less_t)(rb_node_t* a, rb_node_t* b);
+
+#define rb_entry(ptr, type, member) ((type*)((char*)(ptr)-offsetof(type, member)))
+
+void rb_insert(rbtree_t* t, rb_node_t* node, rb_less_t less);
+void rb_erase(rbtree_t* t, rb_node_t* node);
+rb_node_t* rb_next(rb_node_t* node);
+
+static inline rb_node_t* rb_first(rbtree_t* t)
+{
+    return t->leftmost;
+}
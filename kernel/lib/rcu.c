@@ -0,0 +1,122 @@
+#include "rcu.h"
+#include "klog.h"
+#include "semaphore.h"
+#include "sys/smp/smp.h"
+
+// per-cpu quiescent state tracking
+typedef struct [[gnu::aligned(64)]] {
+    uint64_t qs_seq; // grace period during which the cpu was last quiescent
+    bool idle; // cpu is idle, and so stays quiescent
+} rcu_cpu_t;
+
+static rcu_cpu_t rcu_cpus[CPU_MAX];
+
+// latest grace period started
+static uint64_t gp_seq;
+
+// callbacks waiting for a grace period
+static lock_t cb_lock;
+static rcu_head_t* cb_head;
+static rcu_head_t** cb_tail = &cb_head;
+
+// posted when callbacks become available
+static semaphore_t cb_avail;
+
+void rcu_note_qs(uint16_t cpu)
+{
+    rcu_cpus[cpu].qs_seq = __atomic_load_n(&gp_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&rcu_cpus[cpu].idle, false, __ATOMIC_RELEASE);
+}
+
+// called by the idle task before halting, cleared on the next task switch
+void rcu_idle_enter(uint16_t cpu)
+{
+    rcu_note_qs(cpu);
+    __atomic_store_n(&rcu_cpus[cpu].idle, true, __ATOMIC_SEQ_CST);
+}
+
+// starts a new grace period and waits for every cpu to pass through it
+static void wait_for_gp()
+{
+    uint64_t gp = __atomic_add_fetch(&gp_seq, 1, __ATOMIC_SEQ_CST);
+    uint16_t ncpus = smp_get_info()->num_cpus;
+
+    for (uint16_t i = 0; i < ncpus; i++) {
+        bool kicked = false;
+        while (__atomic_load_n(&rcu_cpus[i].qs_seq, __ATOMIC_ACQUIRE) < gp
+            && !__atomic_load_n(&rcu_cpus[i].idle, __ATOMIC_SEQ_CST)) {
+            // a cpu running a single task has no tick to switch on
+            if (!kicked) {
+                sched_kick(i);
+                kicked = true;
+            }
+            sched_sleep(RCU_POLL_INTERVAL);
+        }
+    }
+}
+
+// runs callbacks once their grace period is over
+_Noreturn static void rcud(tid_t tid)
+{
+    (void)tid;
+    while (true) {
+        sem_wait(&cb_avail);
+
+        // take all pending callbacks
+        lock_wait(&cb_lock);
+        rcu_head_t* batch = cb_head;
+        cb_head = NULL;
+        cb_tail = &cb_head;
+        lock_release(&cb_lock);
+        if (!batch)
+            continue;
+
+        wait_for_gp();
+        while (batch) {
+            rcu_head_t* next = batch->next;
+            batch->func(batch);
+            batch = next;
+        }
+    }
+}
+
+// calls func(head) after all current readers are done
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t*))
+{
+    head->func = func;
+    head->next = NULL;
+
+    lock_wait(&cb_lock);
+    bool was_empty = !cb_head;
+    *cb_tail = head;
+    cb_tail = &head->next;
+    lock_release(&cb_lock);
+
+    if (was_empty)
+        sem_post(&cb_avail);
+}
+
+typedef struct {
+    rcu_head_t head;
+    semaphore_t done;
+} rcu_sync_t;
+
+static void synchronize_done(rcu_head_t* head)
+{
+    sem_post(&((rcu_sync_t*)head)->done);
+}
+
+// waits until all current readers are done
+void synchronize_rcu()
+{
+    rcu_sync_t s;
+    sem_init(&s.done, 0);
+    call_rcu(&s.head, synchronize_done);
+    sem_wait(&s.done);
+}
+
+void rcu_init()
+{
+    task_add(rcud, PRIORITY_MIN, TASK_KERNEL_MODE, NULL, 0);
+    klog_ok("done\n");
+}
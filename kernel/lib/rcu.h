@@ -0,0 +1,38 @@
+#pragma once
+
+#include "proc/sched/sched.h"
+#include <stdint.h>
+
+// how often the rcu daemon checks whether a grace period has ended
+#define RCU_POLL_INTERVAL MILLIS_TO_NANOS(2)
+
+// embedded in objects which are to be freed after a grace period
+typedef struct rcu_head_t {
+    struct rcu_head_t* next;
+    void (*func)(struct rcu_head_t* head);
+} rcu_head_t;
+
+/*
+ * Readers only disable preemption, so a cpu that switches tasks or goes
+ * idle cannot be inside a read-side section. Once every cpu has done so
+ * after an update, the old data is unreachable and can be freed.
+ * Readers must not sleep.
+ */
+static inline void rcu_read_lock()
+{
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock()
+{
+    preempt_enable();
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_init();
+void rcu_note_qs(uint16_t cpu);
+void rcu_idle_enter(uint16_t cpu);
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t*));
+void synchronize_rcu();
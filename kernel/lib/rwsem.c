@@ -0,0 +1,54 @@
+#include "rwsem.h"
+
+// wakes up sleepers, if there are any, so they can try again
+static void wake_waiters(rwsem_t* s)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&s->waiters, __ATOMIC_RELAXED))
+        return;
+
+    lock_wait(&s->wq.lock);
+    waitq_wake_all(&s->wq);
+    lock_release(&s->wq.lock);
+}
+
+void rwsem_read_lock(rwsem_t* s)
+{
+    if (rwlock_try_read(&s->rw))
+        return;
+
+    lock_wait(&s->wq.lock);
+    __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!rwlock_try_read(&s->rw))
+        waitq_sleep(&s->wq);
+    __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+    lock_release(&s->wq.lock);
+}
+
+void rwsem_read_unlock(rwsem_t* s)
+{
+    rwlock_end_read(&s->rw);
+    wake_waiters(s);
+}
+
+void rwsem_write_lock(rwsem_t* s)
+{
+    if (rwlock_try_write(&s->rw))
+        return;
+
+    // hold off new readers while we wait
+    __atomic_fetch_add(&s->rw.writers_waiting, 1, __ATOMIC_SEQ_CST);
+    lock_wait(&s->wq.lock);
+    __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!rwlock_try_write(&s->rw))
+        waitq_sleep(&s->wq);
+    __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+    lock_release(&s->wq.lock);
+    __atomic_fetch_sub(&s->rw.writers_waiting, 1, __ATOMIC_RELAXED);
+}
+
+void rwsem_write_unlock(rwsem_t* s)
+{
+    rwlock_end_write(&s->rw);
+    wake_waiters(s);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "lock.h"
+#include "proc/sched/waitq.h"
+
+/*
+ * A sleeping reader-writer lock, for long critical sections. The fast
+ * paths are the same as rwlock_t, contended tasks sleep on a wait queue
+ * instead of spinning. Must not be used from interrupt context.
+ */
+typedef struct {
+    rwlock_t rw;
+    uint32_t waiters; // number of tasks sleeping on wq
+    waitq_t wq;
+} rwsem_t;
+
+void rwsem_read_lock(rwsem_t* s);
+void rwsem_read_unlock(rwsem_t* s);
+void rwsem_write_lock(rwsem_t* s);
+void rwsem_write_unlock(rwsem_t* s);
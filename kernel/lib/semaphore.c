@@ -0,0 +1,37 @@
+#include "semaphore.h"
+
+void sem_init(semaphore_t* s, int64_t count)
+{
+    *s = (semaphore_t) { .count = count };
+}
+
+bool sem_trywait(semaphore_t* s)
+{
+    int64_t c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    while (c > 0) {
+        if (__atomic_compare_exchange_n(&s->count, &c, c - 1, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+void sem_wait(semaphore_t* s)
+{
+    if (sem_trywait(s))
+        return;
+
+    lock_wait(&s->wq.lock);
+    while (!sem_trywait(s))
+        waitq_sleep(&s->wq);
+    lock_release(&s->wq.lock);
+}
+
+// can be called from interrupt context
+void sem_post(semaphore_t* s)
+{
+    lock_wait(&s->wq.lock);
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELEASE);
+    waitq_wake_one(&s->wq);
+    lock_release(&s->wq.lock);
+}
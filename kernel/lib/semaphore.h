@@ -0,0 +1,15 @@
+#pragma once
+
+#include "proc/sched/waitq.h"
+#include <stdint.h>
+
+// a counting semaphore, tasks sleep while the count is zero
+typedef struct {
+    int64_t count;
+    waitq_t wq;
+} semaphore_t;
+
+void sem_init(semaphore_t* s, int64_t count);
+bool sem_trywait(semaphore_t* s);
+void sem_wait(semaphore_t* s);
+void sem_post(semaphore_t* s);
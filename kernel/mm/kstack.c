@@ -0,0 +1,116 @@
+/*
+    Kernel stacks, mapped in their own region with a guard page below each
+    one so an overflow faults instead of corrupting whatever is next.
+
+    Stacks are never unmapped. Another cpu may still hold a tlb entry for
+    a stack, and if its pages went back to the pmm a stray write through
+    that entry would land in their next owner. So a released stack keeps
+    its slot and its pages together, and is handed out again as a whole.
+    Mapping is the slow part, so each cpu keeps a few stacks around too.
+*/
+#include "kstack.h"
+#include "klog.h"
+#include "lock.h"
+#include "sys/panic.h"
+#include "sys/smp/smp.h"
+#include "vmm.h"
+
+typedef struct {
+    lock_t lock;
+    void* stacks[KSTACK_CACHE_MAX];
+    uint64_t len;
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64))) kstack_cache_t;
+
+static kstack_cache_t kstack_caches[CPU_MAX];
+
+static lock_t region_lock;
+static uint64_t next_slot = KSTACK_REGION_BASE;
+
+// released stacks, linked through their lowest word
+static void* free_stacks;
+static uint64_t nr_free_stacks;
+
+static void* map_stack()
+{
+    lock_wait(&region_lock);
+    if (free_stacks) {
+        void* stack = free_stacks;
+        free_stacks = *(void**)stack;
+        nr_free_stacks--;
+        lock_release(&region_lock);
+        return stack;
+    }
+
+    if (next_slot + KSTACK_SLOT_SIZE > KSTACK_REGION_BASE + KSTACK_REGION_SIZE)
+        kernel_panic("out of kernel stack space\n");
+
+    // skip the guard page
+    uint64_t stack = next_slot + PAGE_SIZE;
+    next_slot += KSTACK_SLOT_SIZE;
+    for (uint64_t i = 0; i < KSTACK_PAGES; i++)
+        vmm_map(NULL, stack + i * PAGE_SIZE, pmm_get(1), 1, VMM_FLAGS_DEFAULT);
+    lock_release(&region_lock);
+    return (void*)stack;
+}
+
+// keeps the stack mapped, see above
+static void release_stack(void* stack)
+{
+    lock_wait(&region_lock);
+    *(void**)stack = free_stacks;
+    free_stacks = stack;
+    nr_free_stacks++;
+    lock_release(&region_lock);
+}
+
+// returns the lowest address of a KSTACK_SIZE stack
+void* kstack_alloc()
+{
+    kstack_cache_t* c = &kstack_caches[smp_get_current_info()->cpu_id];
+    void* stack = NULL;
+    lock_wait(&c->lock);
+    if (c->len) {
+        stack = c->stacks[--c->len];
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+    lock_release(&c->lock);
+
+    return stack ? stack : map_stack();
+}
+
+void kstack_free(void* stack)
+{
+    kstack_cache_t* c = &kstack_caches[smp_get_current_info()->cpu_id];
+    lock_wait(&c->lock);
+    if (c->len < KSTACK_CACHE_MAX) {
+        c->stacks[c->len++] = stack;
+        stack = NULL;
+    }
+    lock_release(&c->lock);
+
+    if (stack)
+        release_stack(stack);
+}
+
+// cache hits and misses of kstack_alloc(), on all cpus
+void kstack_getstats(uint64_t* hits, uint64_t* misses)
+{
+    *hits = *misses = 0;
+    for (int i = 0; i < CPU_MAX; i++) {
+        *hits += __atomic_load_n(&kstack_caches[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&kstack_caches[i].misses, __ATOMIC_RELAXED);
+    }
+}
+
+void kstack_dumpstats()
+{
+    uint64_t hits, misses;
+    kstack_getstats(&hits, &misses);
+    klog_info("%d KiB stacks, %d cache hits, %d misses, %d slots used, %d released\n",
+        KSTACK_SIZE / 1024, hits, misses, (next_slot - KSTACK_REGION_BASE) / KSTACK_SLOT_SIZE,
+        nr_free_stacks);
+}
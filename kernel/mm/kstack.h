@@ -0,0 +1,28 @@
+#pragma once
+
+#include "pmm.h"
+#include <stdint.h>
+
+// stack size in pages, can be set from 2 (8 KiB) to 4 (16 KiB)
+#ifndef KSTACK_PAGES
+#define KSTACK_PAGES 2
+#endif
+
+#if KSTACK_PAGES < 2 || KSTACK_PAGES > 4
+#error "KSTACK_PAGES must be between 2 and 4"
+#endif
+
+#define KSTACK_SIZE (KSTACK_PAGES * PAGE_SIZE)
+
+// stacks live here, each one below an unmapped guard page
+#define KSTACK_REGION_BASE 0xffffc00000000000
+#define KSTACK_REGION_SIZE 0x8000000000
+#define KSTACK_SLOT_SIZE (KSTACK_SIZE + PAGE_SIZE)
+
+// mapped stacks each cpu keeps around
+#define KSTACK_CACHE_MAX 16
+
+void* kstack_alloc();
+void kstack_free(void* stack);
+void kstack_getstats(uint64_t* hits, uint64_t* misses);
+void kstack_dumpstats();
@@ -1,4 +1,5 @@
 #pragma once
 
+#include "kstack.h"
 #include "pmm.h"
 #include "vmm.h"
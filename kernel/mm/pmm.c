@@ -4,6 +4,7 @@
 #include "dev/fb/fb.h"
 #include "klog.h"
 #include "memutils.h"
+#include "proc/acct.h"
 #include "sys/panic.h"
 #include "vmm.h"
 #include <stddef.h>
@@ -40,6 +41,7 @@ static bool bmp_isfree(uint64_t addr, uint64_t numpages)
 // marks pages as free
 void pmm_free(uint64_t addr, uint64_t numpages)
 {
+    acct_add(pages_freed, numpages);
     for (uint64_t i = addr; i < addr + (numpages * PAGE_SIZE); i += PAGE_SIZE) {
         if (!bmp_isfree(i, 1))
             memstats.free_mem += PAGE_SIZE;
@@ -64,13 +66,17 @@ uint64_t pmm_get(uint64_t numpages)
     static uint64_t lastusedpage;
 
     for (uint64_t i = lastusedpage; i < memstats.phys_limit; i += PAGE_SIZE) {
-        if (pmm_alloc(i, numpages))
+        if (pmm_alloc(i, numpages)) {
+            acct_add(pages_alloc, numpages);
             return i;
+        }
     }
 
     for (uint64_t i = 0; i < lastusedpage; i += PAGE_SIZE) {
-        if (pmm_alloc(i, numpages))
+        if (pmm_alloc(i, numpages)) {
+            acct_add(pages_alloc, numpages);
             return i;
+        }
     }
 
     kernel_panic("Out of Physical Memory");
@@ -102,6 +102,22 @@ done:
     return;
 }
 
+// physical address a virtual one is mapped to, or 0 if it is not mapped
+uint64_t vmm_get_phys(addrspace_t* addrspace, uint64_t vaddr)
+{
+    addrspace_t* as = addrspace ? addrspace : &kaddrspace;
+    uint64_t* table = as->PML4;
+    for (int shift = 39; shift >= 12; shift -= 9) {
+        uint64_t entry = table[(vaddr >> shift) & 0x1ff];
+        if (!(entry & VMM_FLAG_PRESENT))
+            return 0;
+        if (shift == 12)
+            return (entry & ~(0xfff)) | (vaddr & 0xfff);
+        table = (uint64_t*)PHYS_TO_VIRT(entry & ~(0xfff));
+    }
+    return 0;
+}
+
 void vmm_unmap(addrspace_t* addrspace, uint64_t vaddr, uint64_t np)
 {
     addrspace_t* as = addrspace ? addrspace : &kaddrspace;
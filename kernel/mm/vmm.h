@@ -27,3 +27,4 @@ typedef struct {
 void vmm_init();
 void vmm_map(addrspace_t* addrspace, uint64_t vaddr, uint64_t paddr, uint64_t np, uint64_t flags);
 void vmm_unmap(addrspace_t* addrspace, uint64_t vaddr, uint64_t np);
+uint64_t vmm_get_phys(addrspace_t* addrspace, uint64_t vaddr);
@@ -0,0 +1,111 @@
+/*
+    Resource accounting, and the load average.
+
+    The counters themselves live in each task, and are updated where the
+    resource is used. This gathers them up for a top-like tool. The load
+    average is the number of tasks running or ready to run, sampled
+    periodically and decayed exponentially over 1, 5 and 15 minutes.
+*/
+#include "acct.h"
+#include "klog.h"
+#include "rcu.h"
+#include "tid.h"
+
+static uint64_t loadavg[3];
+
+static uint64_t calc_load(uint64_t load, uint64_t exp, uint64_t active)
+{
+    return (load * exp + active * (LOADAVG_FIXED_1 - exp)) >> LOADAVG_FSHIFT;
+}
+
+_Noreturn static void loadavgd(tid_t tid)
+{
+    (void)tid;
+    while (true) {
+        sched_sleep(LOADAVG_INTERVAL);
+
+        // we are running ourselves, and should not count. but a racing
+        // wake or migration may have left us out, so don't wrap around
+        uint64_t nr = sched_get_nr_running();
+        uint64_t active = (nr ? nr - 1 : 0) * LOADAVG_FIXED_1;
+        uint64_t avg[3] = {
+            calc_load(loadavg[0], LOADAVG_EXP_1, active),
+            calc_load(loadavg[1], LOADAVG_EXP_5, active),
+            calc_load(loadavg[2], LOADAVG_EXP_15, active)
+        };
+        for (int i = 0; i < 3; i++)
+            __atomic_store_n(&loadavg[i], avg[i], __ATOMIC_RELAXED);
+    }
+}
+
+// over 1, 5 and 15 minutes, with LOADAVG_FSHIFT fractional bits
+void acct_get_loadavg(uint64_t avg[3])
+{
+    for (int i = 0; i < 3; i++)
+        avg[i] = __atomic_load_n(&loadavg[i], __ATOMIC_RELAXED);
+}
+
+static void fill_info(task_t* t, task_info_t* info)
+{
+    info->tid = t->tid;
+    info->priority = t->priority;
+    info->policy = t->policy;
+    info->status = t->status;
+    info->cpu = t->last_cpu;
+    info->acct = t->acct;
+}
+
+// returns -1 if there is no such task
+int acct_get_task(tid_t tid, task_info_t* info)
+{
+    rcu_read_lock();
+    task_t* t = tid_lookup(tid);
+    if (t)
+        fill_info(t, info);
+    rcu_read_unlock();
+    return t ? 0 : -1;
+}
+
+// fills in up to n tasks, in order of tid, and returns how many
+size_t acct_list_tasks(task_info_t* buf, size_t n)
+{
+    size_t found = 0;
+    for (uint64_t tid = 0; tid < TID_MAX && found < n; tid++)
+        if (acct_get_task(tid, &buf[found]) == 0)
+            found++;
+    return found;
+}
+
+void acct_init()
+{
+    task_add(loadavgd, PRIORITY_MIN, TASK_KERNEL_MODE, NULL, 0);
+    klog_ok("done\n");
+}
+
+static void print_load(uint64_t avg)
+{
+    uint64_t frac = ((avg & (LOADAVG_FIXED_1 - 1)) * 100) >> LOADAVG_FSHIFT;
+    klog_printf(" %d.%d%d", avg >> LOADAVG_FSHIFT, frac / 10, frac % 10);
+}
+
+void acct_dumpstats()
+{
+    static task_info_t tasks[64];
+    uint64_t avg[3];
+    acct_get_loadavg(avg);
+
+    klog_info("task accounting\n");
+    klog_printf(" \t \tload average:");
+    for (int i = 0; i < 3; i++)
+        print_load(avg[i]);
+    klog_printf(", %d tasks\n", tid_get_used());
+
+    size_t n = acct_list_tasks(tasks, sizeof(tasks) / sizeof(tasks[0]));
+    for (size_t i = 0; i < n; i++) {
+        task_acct_t* a = &tasks[i].acct;
+        klog_printf(" \t \t  tid %d: user %d us, kernel %d us, %d pages in, %d out, %d bytes read, %d written, %d handles\n",
+            tasks[i].tid, NANOS_TO_MICROS(a->utime), NANOS_TO_MICROS(a->stime), a->pages_alloc,
+            a->pages_freed, a->bytes_read, a->bytes_written, a->nr_handles);
+    }
+    klog_printf("\n");
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "proc/sched/sched.h"
+#include "task.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// the load average is sampled this often
+#define LOADAVG_INTERVAL SECONDS_TO_NANOS(5)
+
+// load averages are fixed point, with this many fractional bits
+#define LOADAVG_FSHIFT 11
+#define LOADAVG_FIXED_1 (1 << LOADAVG_FSHIFT)
+
+// 1 / exp(interval / period), for periods of 1, 5 and 15 minutes
+#define LOADAVG_EXP_1 1884
+#define LOADAVG_EXP_5 2014
+#define LOADAVG_EXP_15 2037
+
+// what a top-like tool sees of a task
+typedef struct {
+    tid_t tid;
+    priority_t priority;
+    sched_policy_t policy;
+    tstatus_t status;
+    uint16_t cpu; // the one it last ran on
+    task_acct_t acct;
+} task_info_t;
+
+/*
+ * Charges the current task, if there is one yet. Counters are only
+ * written by the cpu running the task, so other cpus may read slightly
+ * stale values. Work done in an interrupt handler is charged to whatever
+ * task it interrupted.
+ */
+#define acct_add(field, n)                       \
+    {                                            \
+        task_t* __t = sched_get_current();       \
+        if (__t)                                 \
+            __t->acct.field += (n);              \
+    }
+
+void acct_init();
+void acct_get_loadavg(uint64_t avg[3]);
+int acct_get_task(tid_t tid, task_info_t* info);
+size_t acct_list_tasks(task_info_t* buf, size_t n);
+void acct_dumpstats();
@@ -0,0 +1,175 @@
+/*
+    What a cpu does when it has nothing to run.
+
+    With MONITOR/MWAIT the cpu waits on its need_resched flag, so another
+    cpu which gives it work only has to write the flag, rather than send
+    an ipi. The c-state to wait in is picked from how long the cpu is
+    expected to stay idle, which is when its next timer event is due.
+    Without MWAIT it halts, and has to be woken by an interrupt.
+*/
+#include "idle.h"
+#include "klog.h"
+#include "sys/cpu/cpu.h"
+#include "sys/cpu/cpuid.h"
+#include "sys/smp/smp.h"
+
+// the monitored line holds only the flag, so nothing else wakes the cpu
+typedef struct [[gnu::aligned(64)]] {
+    uint32_t need_resched;
+} idle_flag_t;
+
+typedef struct [[gnu::aligned(64)]] {
+    bool polling; // waiting in mwait, a write to the flag wakes it
+
+    // written by wakers and read back by this cpu, under its run queue lock
+    uint64_t wake_at; // tsc value when the flag was last set, 0 if it isn't
+    idle_wake_t wake_how;
+
+    uint64_t nr_entries[IDLE_MAX_CSTATES];
+    uint64_t nr_wakeups[IDLE_WAKE_MAX];
+    uint64_t wake_cycles[IDLE_WAKE_MAX];
+} idle_cpu_t;
+
+typedef struct {
+    uint32_t hint; // mwait eax
+    timeval_t residency; // shortest idle time it is worth entering for
+} cstate_t;
+
+// rough break-even times, without acpi tables we can't know the real ones
+static const timeval_t cstate_residency[IDLE_MAX_CSTATES] = {
+    0,
+    MICROS_TO_NANOS(20),
+    MICROS_TO_NANOS(100),
+    MICROS_TO_NANOS(300),
+    MICROS_TO_NANOS(600),
+    MICROS_TO_NANOS(1000),
+    MICROS_TO_NANOS(2000)
+};
+
+static idle_flag_t idle_flags[CPU_MAX];
+static idle_cpu_t idle_cpus[CPU_MAX];
+
+static bool has_mwait;
+static cstate_t cstates[IDLE_MAX_CSTATES];
+static int nr_cstates;
+
+// the deepest state worth entering, the shallowest is always allowed
+static int pick_cstate(timeval_t predicted)
+{
+    int i = nr_cstates - 1;
+    while (i > 0 && cstates[i].residency > predicted)
+        i--;
+    return i;
+}
+
+// returns once the flag is set, or an interrupt has come in
+void idle_enter(uint16_t cpu, timeval_t predicted)
+{
+    idle_cpu_t* c = &idle_cpus[cpu];
+    uint32_t* flag = &idle_flags[cpu].need_resched;
+
+    // sti only takes effect after the next instruction, so an interrupt
+    // can't come in between checking the flag and waiting
+    asm volatile("cli");
+    if (!has_mwait) {
+        if (!__atomic_load_n(flag, __ATOMIC_ACQUIRE))
+            asm volatile("sti; hlt");
+        else
+            asm volatile("sti");
+        c->nr_entries[0]++;
+        return;
+    }
+
+    // the flag is checked after arming the monitor, so a write to it
+    // either is seen here or ends the mwait
+    int state = pick_cstate(predicted);
+    __atomic_store_n(&c->polling, true, __ATOMIC_SEQ_CST);
+    asm volatile("monitor" ::"a"(flag), "c"(0), "d"(0));
+    if (!__atomic_load_n(flag, __ATOMIC_SEQ_CST))
+        asm volatile("sti; mwait" ::"a"(cstates[state].hint), "c"(0));
+    else
+        asm volatile("sti");
+    __atomic_store_n(&c->polling, false, __ATOMIC_RELAXED);
+    c->nr_entries[state]++;
+}
+
+bool idle_need_resched(uint16_t cpu)
+{
+    return __atomic_load_n(&idle_flags[cpu].need_resched, __ATOMIC_ACQUIRE);
+}
+
+// sets a cpu's flag, with its run queue locked. returns false if it is
+// not waiting in mwait, and needs an ipi to notice
+bool idle_wake(uint16_t cpu)
+{
+    idle_cpu_t* c = &idle_cpus[cpu];
+    if (!c->wake_at)
+        c->wake_at = rdtsc();
+    __atomic_store_n(&idle_flags[cpu].need_resched, 1, __ATOMIC_SEQ_CST);
+    bool polling = __atomic_load_n(&c->polling, __ATOMIC_SEQ_CST);
+    c->wake_how = polling ? IDLE_WAKE_MONITOR : IDLE_WAKE_IPI;
+    return polling;
+}
+
+// called when the cpu schedules, with its run queue locked. any waker
+// from now on sees it is not polling, and sends an ipi if needed
+void idle_clear(uint16_t cpu, bool was_idle)
+{
+    idle_cpu_t* c = &idle_cpus[cpu];
+    __atomic_store_n(&c->polling, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&idle_flags[cpu].need_resched, 0, __ATOMIC_RELAXED);
+    if (c->wake_at && was_idle) {
+        c->nr_wakeups[c->wake_how]++;
+        c->wake_cycles[c->wake_how] += rdtsc() - c->wake_at;
+    }
+    c->wake_at = 0;
+}
+
+void idle_init()
+{
+    nr_cstates = 1;
+    has_mwait = cpuid_check_feature(CPUID_FEATURE_MONITOR);
+    if (!has_mwait) {
+        klog_ok("using hlt\n");
+        return;
+    }
+
+    // edx has the number of sub-states of each c-state, in 4 bit fields.
+    // the local apic timer may stop in anything deeper than C1
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(5, 0, &eax, &ebx, &ecx, &edx);
+    cstates[0].hint = 0;
+    if ((ecx & 1) && cpuid_check_feature(CPUID_FEATURE_ARAT)) {
+        for (int i = 1; i < IDLE_MAX_CSTATES; i++) {
+            if (!((edx >> ((i + 1) * 4)) & 0xf))
+                continue;
+            cstates[nr_cstates].hint = i << 4;
+            cstates[nr_cstates].residency = cstate_residency[i];
+            nr_cstates++;
+        }
+    }
+    klog_ok("using mwait, %d c-states\n", nr_cstates);
+}
+
+void idle_dumpstats()
+{
+    uint64_t entries[IDLE_MAX_CSTATES] = { 0 };
+    uint64_t wakeups[IDLE_WAKE_MAX] = { 0 };
+    uint64_t cycles[IDLE_WAKE_MAX] = { 0 };
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    for (uint16_t i = 0; i < ncpus; i++) {
+        for (int s = 0; s < IDLE_MAX_CSTATES; s++)
+            entries[s] += idle_cpus[i].nr_entries[s];
+        for (int w = 0; w < IDLE_WAKE_MAX; w++) {
+            wakeups[w] += idle_cpus[i].nr_wakeups[w];
+            cycles[w] += idle_cpus[i].wake_cycles[w];
+        }
+    }
+
+    klog_info("idle statistics\n");
+    for (int s = 0; s < nr_cstates; s++)
+        klog_printf(" \t \thint %x: %d entries\n", (uint64_t)cstates[s].hint, entries[s]);
+    klog_printf(" \t \tremote wakeups: %d by ipi, %d cycles avg; %d by monitor, %d cycles avg\n\n",
+        wakeups[IDLE_WAKE_IPI], wakeups[IDLE_WAKE_IPI] ? cycles[IDLE_WAKE_IPI] / wakeups[IDLE_WAKE_IPI] : 0,
+        wakeups[IDLE_WAKE_MONITOR], wakeups[IDLE_WAKE_MONITOR] ? cycles[IDLE_WAKE_MONITOR] / wakeups[IDLE_WAKE_MONITOR] : 0);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "lib/time.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// mwait c-states, C1 to C7
+#define IDLE_MAX_CSTATES 7
+
+// how a remote cpu woke an idle one
+typedef enum {
+    IDLE_WAKE_IPI,
+    IDLE_WAKE_MONITOR,
+    IDLE_WAKE_MAX
+} idle_wake_t;
+
+void idle_init();
+void idle_enter(uint16_t cpu, timeval_t predicted);
+bool idle_need_resched(uint16_t cpu);
+bool idle_wake(uint16_t cpu);
+void idle_clear(uint16_t cpu, bool was_idle);
+void idle_dumpstats();
@@ -0,0 +1,306 @@
+#include "parallel.h"
+#include "klog.h"
+#include "lock.h"
+#include "memutils.h"
+#include "mm/mm.h"
+#include "sched.h"
+#include "sys/hpet.h"
+#include "sys/smp/smp.h"
+
+// the owner works at the bottom, thieves take from the top
+typedef struct {
+    lock_t lock;
+    pjob_t jobs[PARALLEL_DEQUE_LEN];
+    uint64_t top;
+    uint64_t bottom;
+    uint64_t nr_steals; // jobs this cpu took from others
+} __attribute__((aligned(64))) pdeque_t;
+
+static pdeque_t deques[CPU_MAX];
+
+// workers sleep here while every deque is empty
+static waitq_t idle_workers;
+static uint64_t nr_queued;
+static uint64_t nr_idle; // workers about to sleep or asleep on idle_workers
+
+// workers on cpus from this one up sit out, so scaling can be measured
+static uint16_t nr_cpus_used = CPU_MAX;
+static waitq_t parked_workers;
+
+static bool push_bottom(pdeque_t* d, const pjob_t* j)
+{
+    bool pushed = false;
+    lock_wait(&d->lock);
+    if (d->bottom - d->top < PARALLEL_DEQUE_LEN) {
+        d->jobs[d->bottom++ % PARALLEL_DEQUE_LEN] = *j;
+        pushed = true;
+    }
+    lock_release(&d->lock);
+    return pushed;
+}
+
+static bool pop_bottom(pdeque_t* d, pjob_t* j)
+{
+    bool popped = false;
+    lock_wait(&d->lock);
+    if (d->bottom != d->top) {
+        *j = d->jobs[--d->bottom % PARALLEL_DEQUE_LEN];
+        popped = true;
+    }
+    lock_release(&d->lock);
+    return popped;
+}
+
+// a busy deque is skipped rather than waited for
+static bool steal_top(pdeque_t* d, pjob_t* j)
+{
+    if (d->bottom == d->top || !lock_try(&d->lock))
+        return false;
+
+    bool stolen = false;
+    if (d->bottom != d->top) {
+        *j = d->jobs[d->top++ % PARALLEL_DEQUE_LEN];
+        stolen = true;
+    }
+    lock_release_try(&d->lock);
+    return stolen;
+}
+
+// our own newest job, or else the oldest one of some other cpu
+static bool find_job(pjob_t* j)
+{
+    uint16_t cpu = smp_get_current_info()->cpu_id;
+    if (pop_bottom(&deques[cpu], j))
+        goto found;
+
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    uint16_t used = __atomic_load_n(&nr_cpus_used, __ATOMIC_RELAXED);
+    if (used < ncpus)
+        ncpus = used;
+    for (uint16_t i = 1; cpu < ncpus && i < ncpus; i++) {
+        if (steal_top(&deques[(cpu + i) % ncpus], j)) {
+            deques[cpu].nr_steals++;
+            goto found;
+        }
+    }
+    return false;
+
+found:
+    __atomic_fetch_sub(&nr_queued, 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+// counts a job just pushed, and wakes a worker for it
+static void queue_job()
+{
+    __atomic_fetch_add(&nr_queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&nr_idle, __ATOMIC_SEQ_CST)) {
+        lock_wait(&idle_workers.lock);
+        waitq_wake_one(&idle_workers);
+        lock_release(&idle_workers.lock);
+    }
+}
+
+static void job_done(task_group_t* g)
+{
+    if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    // the waiter may free the group once done is set and we let go. more
+    // jobs may have been added since we looked
+    lock_wait(&g->wq.lock);
+    if (!__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) {
+        g->done = true;
+        waitq_wake_all(&g->wq);
+    }
+    lock_release(&g->wq.lock);
+}
+
+static void run_job(pjob_t j)
+{
+    task_group_t* g = j.group;
+    while (j.end - j.begin > j.grain) {
+        pjob_t right = j;
+        right.begin = j.begin + (j.end - j.begin) / 2;
+
+        // with our deque full, the rest is done here without splitting
+        __atomic_fetch_add(&g->pending, 1, __ATOMIC_RELAXED);
+        if (!push_bottom(&deques[smp_get_current_info()->cpu_id], &right)) {
+            __atomic_fetch_sub(&g->pending, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        queue_job();
+        j.end = right.begin;
+    }
+    j.fn(j.begin, j.end, j.arg);
+    job_done(g);
+}
+
+_Noreturn static void worker(tid_t tid)
+{
+    (void)tid;
+    uint16_t cpu = smp_get_current_info()->cpu_id;
+    pjob_t j;
+    while (true) {
+        if (cpu >= __atomic_load_n(&nr_cpus_used, __ATOMIC_RELAXED)) {
+            lock_wait(&parked_workers.lock);
+            if (cpu >= nr_cpus_used)
+                waitq_sleep(&parked_workers);
+            lock_release(&parked_workers.lock);
+            continue;
+        }
+
+        if (find_job(&j)) {
+            run_job(j);
+            continue;
+        }
+
+        // either we see a job queued after we looked, or queue_job()
+        // sees us and wakes us up
+        lock_wait(&idle_workers.lock);
+        __atomic_fetch_add(&nr_idle, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&nr_queued, __ATOMIC_SEQ_CST))
+            waitq_sleep(&idle_workers);
+        __atomic_fetch_sub(&nr_idle, 1, __ATOMIC_RELAXED);
+        lock_release(&idle_workers.lock);
+    }
+}
+
+// starts a worker on every cpu
+void parallel_init()
+{
+    const smp_info_t* info = smp_get_info();
+    for (uint16_t i = 0; i < info->num_cpus; i++) {
+        task_t* t = task_make(worker, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+        if (!t)
+            continue;
+        cpumask_zero(&(t->affinity));
+        cpumask_set(&(t->affinity), i);
+        sched_add(t);
+    }
+    klog_ok("%d workers started\n", info->num_cpus);
+}
+
+void task_group_init(task_group_t* g)
+{
+    memset((void*)g, 0, sizeof(task_group_t));
+    g->done = true;
+}
+
+// splits [begin, end) into pieces of at most grain, and runs fn on each
+void task_group_for(task_group_t* g, uint64_t begin, uint64_t end, uint64_t grain, parallel_fn_t fn, void* arg)
+{
+    if (begin >= end)
+        return;
+
+    pjob_t j = {
+        .fn = fn,
+        .arg = arg,
+        .begin = begin,
+        .end = end,
+        .grain = grain ? grain : 1,
+        .group = g
+    };
+    if (!__atomic_fetch_add(&g->pending, 1, __ATOMIC_ACQ_REL)) {
+        lock_wait(&g->wq.lock);
+        g->done = false;
+        lock_release(&g->wq.lock);
+    }
+
+    // nowhere to put it, so do it now
+    if (!push_bottom(&deques[smp_get_current_info()->cpu_id], &j)) {
+        run_job(j);
+        return;
+    }
+    queue_job();
+}
+
+// runs fn(0, 1, arg) as a single job
+void task_group_run(task_group_t* g, parallel_fn_t fn, void* arg)
+{
+    task_group_for(g, 0, 1, 1, fn, arg);
+}
+
+// helps out until every job in the group has finished
+void task_group_wait(task_group_t* g)
+{
+    pjob_t j;
+    while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) && find_job(&j))
+        run_job(j);
+
+    // the last ones are still running elsewhere
+    lock_wait(&g->wq.lock);
+    while (!g->done)
+        waitq_sleep(&g->wq);
+    lock_release(&g->wq.lock);
+}
+
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain, parallel_fn_t fn, void* arg)
+{
+    task_group_t g;
+    task_group_init(&g);
+    task_group_for(&g, begin, end, grain, fn, arg);
+    task_group_wait(&g);
+}
+
+uint64_t parallel_get_steals(uint16_t cpu)
+{
+    return deques[cpu].nr_steals;
+}
+
+static void set_cpus_used(uint16_t n)
+{
+    lock_wait(&parked_workers.lock);
+    nr_cpus_used = n;
+    waitq_wake_all(&parked_workers);
+    lock_release(&parked_workers.lock);
+}
+
+static void zero_pages(uint64_t begin, uint64_t end, void* arg)
+{
+    memset((uint8_t*)arg + begin * PAGE_SIZE, 0, (end - begin) * PAGE_SIZE);
+}
+
+// zeroes the same memory on 1, 2, 4... cpus, from cpu 0
+void parallel_benchmark()
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    task_t* curr = sched_get_current();
+    cpumask_t mask;
+    cpumask_zero(&mask);
+    cpumask_set(&mask, 0);
+    sched_set_affinity(curr, &mask);
+    while (smp_get_current_info()->cpu_id != 0)
+        sched_yield();
+
+    void* buf = (void*)PHYS_TO_VIRT(pmm_get(PARALLEL_BENCH_PAGES));
+    uint64_t bytes = PARALLEL_BENCH_PAGES * PAGE_SIZE;
+
+    // the first run only gets the workers going
+    parallel_for(0, PARALLEL_BENCH_PAGES, PARALLEL_BENCH_GRAIN, zero_pages, buf);
+
+    klog_info("parallel zeroing of %d KiB\n", bytes / 1024);
+    timeval_t base = 0;
+    for (uint16_t n = 1;; n = n * 2 < ncpus ? n * 2 : ncpus) {
+        set_cpus_used(n);
+        timeval_t start = hpet_get_nanos();
+        parallel_for(0, PARALLEL_BENCH_PAGES, PARALLEL_BENCH_GRAIN, zero_pages, buf);
+        timeval_t t = hpet_get_nanos() - start;
+        if (n == 1)
+            base = t;
+        klog_printf(" \t \t%d cpus: %d us, %d MB/s, %d.%dx\n", n, NANOS_TO_MICROS(t),
+            t ? bytes * 1000 / t : 0, t ? base / t : 0, t ? base * 10 / t % 10 : 0);
+        if (n == ncpus)
+            break;
+    }
+    set_cpus_used(CPU_MAX);
+
+    klog_printf(" \t \tsteals:");
+    for (uint16_t i = 0; i < ncpus; i++)
+        klog_printf(" %d", parallel_get_steals(i));
+    klog_printf("\n\n");
+
+    pmm_free(VIRT_TO_PHYS(buf), PARALLEL_BENCH_PAGES);
+    cpumask_fill(&mask);
+    sched_set_affinity(curr, &mask);
+}
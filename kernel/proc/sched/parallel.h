@@ -0,0 +1,47 @@
+#pragma once
+
+#include "waitq.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// jobs each cpu's deque can hold, further splits are run inline
+#define PARALLEL_DEQUE_LEN 256
+
+// memory zeroed by parallel_benchmark(), and the piece each job gets
+#define PARALLEL_BENCH_PAGES 4096
+#define PARALLEL_BENCH_GRAIN 16
+
+// called on a piece [begin, end) of a range
+typedef void (*parallel_fn_t)(uint64_t begin, uint64_t end, void* arg);
+
+// a set of jobs which can be waited on together
+typedef struct {
+    uint64_t pending; // jobs queued or running
+    bool done; // no jobs left, only changed under wq.lock
+    waitq_t wq;
+} task_group_t;
+
+// a piece of a range, split in half until it is no bigger than grain
+typedef struct {
+    parallel_fn_t fn;
+    void* arg;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t grain;
+    task_group_t* group;
+} pjob_t;
+
+/*
+ * Jobs are split lazily: whoever runs one pushes its right half onto its
+ * cpu's deque and carries on with the left. Idle workers, and tasks
+ * waiting on a group, steal the oldest and so biggest pieces from the
+ * other end of other cpus' deques.
+ */
+void parallel_init();
+void task_group_init(task_group_t* g);
+void task_group_run(task_group_t* g, parallel_fn_t fn, void* arg);
+void task_group_for(task_group_t* g, uint64_t begin, uint64_t end, uint64_t grain, parallel_fn_t fn, void* arg);
+void task_group_wait(task_group_t* g);
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain, parallel_fn_t fn, void* arg);
+uint64_t parallel_get_steals(uint16_t cpu);
+void parallel_benchmark();
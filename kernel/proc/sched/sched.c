@@ -3,173 +3,806 @@
 #include "lib/klog.h"
 #include "lib/time.h"
 #include "lock.h"
+#include "rbtree.h"
+#include "idle.h"
+#include "rcu.h"
+#include "schedstat.h"
 #include "sys/apic/apic.h"
 #include "sys/apic/timer.h"
+#include "sys/cpu/cpu.h"
+#include "sys/cpu/fpu.h"
 #include "sys/hpet.h"
+#include "sleepq.h"
+#include "softirq.h"
 #include "sys/smp/smp.h"
 #include "tqueue.h"
 
 #define TIMESLICE_DEFAULT MILLIS_TO_NANOS(1)
 
-static lock_t sched_lock;
+// how often (in ticks) a busy cpu checks if it should take on more work
+#define SCHED_BALANCE_TICKS 16
 
-// an idle task for each cpu
-static task_t* tasks_idle[CPU_MAX];
+// a busy cpu only pulls work if the busiest one has this much more (percent)
+#define SCHED_IMBALANCE_PCT 125
 
-// currently running task
-static task_t* tasks_running[CPU_MAX];
+// tasks which ran more recently than this are cache-hot, and are left
+// where they are by busy cpus
+#define SCHED_MIGRATION_COST MICROS_TO_NANOS(500)
 
-// tasks grouped by priority
-static tqueue_t tasks_bg;
-static tqueue_t tasks_min;
-static tqueue_t tasks_mid;
-static tqueue_t tasks_max;
+// how many ready tasks the balancer looks at on the busiest cpu
+#define SCHED_PULL_SCAN 8
 
-// sleeping tasks arranged in descending order of their wakeup time
-static tqueue_t tasks_asleep;
+// how far behind the others a waking task's vruntime may be placed
+#define SCHED_SLEEPER_BONUS MILLIS_TO_NANOS(3)
+
+// a woken fair task preempts the current one if it is this far behind
+#define SCHED_WAKEUP_GRAN MICROS_TO_NANOS(500)
+
+// per-cpu run queue
+typedef struct [[gnu::aligned(64)]] {
+    lock_t lock;
+    bool online;
+    uint64_t ticks; // number of context switches on this cpu
+    bool tick_stopped; // no timeslice end is programmed, only wakeups
+    timeval_t next_event; // when the timer is due, UINT64_MAX if never
+
+    task_t* curr; // currently running task
+    uint32_t curr_rank; // task_rank() of curr, read by other cpus without the lock
+    task_t* idle; // idle task for this cpu
+    uint64_t cr3; // loaded address space, kernel tasks keep whatever it is
+
+    // deadline class, ready tasks ordered by deadline
+    rbtree_t dl_tree;
+    uint64_t dl_bw; // bandwidth reserved by admitted tasks, under dl_lock
+
+    // real-time class, a fifo for each level
+    tqueue_t rt_queues[SCHED_RT_LEVELS];
+    uint32_t rt_bitmap; // levels with ready tasks
+
+    // fair class, ready tasks ordered by vruntime
+    rbtree_t fair_tree;
+    uint64_t min_vruntime; // only moves forward, waking tasks are placed near it
+
+    // background class, runs only when no fair task is ready
+    tqueue_t tasks_bg;
+
+    uint64_t nr_ready; // number of tasks in the above queues
+    uint64_t nr_migrations; // tasks moved to this cpu from others
+
+    // sleeping tasks, ordered by wakeup time
+    sleepq_t tasks_asleep;
+
+    schedstat_cpu_t stats;
+} runqueue_t;
+
+static runqueue_t runqueues[CPU_MAX];
+
+// the task running on this cpu, the same as its run queue's curr but
+// readable without knowing which cpu we are on
+PER_CPU(task_t*, current_task);
+PER_CPU(uint32_t, preempt_count);
+
+// serializes admission of deadline tasks
+static lock_t dl_lock;
 
 // temporary space to hold dead tasks, before janitor cleans them
+static lock_t dead_lock;
 static tqueue_t tasks_dead;
+static task_t* janitor;
+static bool janitor_asleep; // janitor is blocked, the next death wakes it
 
 extern void init_context_switch(void* v);
-extern void finish_context_switch(task_t* next);
+extern void switch_to(void** prev_sp, void* next_sp, volatile bool* prev_on_cpu);
 
 _Noreturn static void idle(tid_t tid)
 {
     (void)tid;
-    while (true)
-        asm volatile("hlt");
+    uint16_t cpu = smp_get_current_info()->cpu_id;
+    runqueue_t* rq = &runqueues[cpu];
+    while (true) {
+        // an idle cpu is not inside any rcu read-side section
+        rcu_idle_enter(cpu);
+
+        // nothing can happen before the timer fires, unless someone wakes us
+        timeval_t now = hpet_get_nanos();
+        timeval_t next = rq->next_event;
+        idle_enter(cpu, next > now ? next - now : 0);
+        if (idle_need_resched(cpu))
+            schedule();
+    }
 }
 
-// the janitor, runs every second to clean up dead tasks
-// TODO: run it on demand
+// the janitor, cleans up dead tasks whenever there are any
 _Noreturn static void sched_janitor(tid_t tid)
 {
     (void)tid;
+    lock_wait(&dead_lock);
     while (true) {
-        lock_wait(&sched_lock);
-        task_t* t;
-        while ((t = tq_pop_back(&tasks_dead))) {
-            kmfree(t->kstack_limit);
-            kmfree(t);
+        while (tasks_dead.front) {
+            // take them all, so they can share a grace period
+            tqueue_t batch = tasks_dead;
+            tasks_dead = (tqueue_t) { 0 };
+            lock_release(&dead_lock);
+
+            // the cpu it died on may not have left its stack yet
+            for (task_t* t = batch.front; t; t = t->next) {
+                while (((volatile task_t*)t)->on_cpu)
+                    asm volatile("pause");
+                task_unpublish(t);
+            }
+
+            // someone may have looked a task up just before
+            synchronize_rcu();
+            task_t* t;
+            while ((t = tq_pop_back(&batch)))
+                task_free(t);
+            lock_wait(&dead_lock);
         }
-        lock_release(&sched_lock);
-        sched_sleep(SECONDS_TO_NANOS(1));
+        janitor_asleep = true;
+        sched_block(&dead_lock);
+        lock_wait(&dead_lock);
+    }
+}
+
+// scheduling classes, a ready task in a higher class always runs first
+typedef enum {
+    CLASS_IDLE,
+    CLASS_BG,
+    CLASS_FAIR,
+    CLASS_RT,
+    CLASS_DL
+} sched_class_t;
+
+// normal tasks above PRIORITY_BG are in the fair class
+static inline sched_class_t task_class(task_t* t)
+{
+    switch (t->policy) {
+    case SCHED_DEADLINE:
+        return CLASS_DL;
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return CLASS_RT;
+    default:
+        if (t->priority == PRIORITY_IDLE)
+            return CLASS_IDLE;
+        return t->priority > PRIORITY_BG ? CLASS_FAIR : CLASS_BG;
+    }
+}
+
+// how important a task is when picking a cpu for a woken one. only a
+// higher class or real-time level is sure to preempt
+static inline uint32_t task_rank(task_t* t)
+{
+    sched_class_t c = task_class(t);
+    return (c << 8) | (c == CLASS_RT ? t->rt_priority : 0);
+}
+
+static inline bool is_fair(task_t* t)
+{
+    return task_class(t) == CLASS_FAIR;
+}
+
+static bool deadline_less(rb_node_t* a, rb_node_t* b)
+{
+    return rb_entry(a, task_t, run_node)->dl_deadline < rb_entry(b, task_t, run_node)->dl_deadline;
+}
+
+static bool vruntime_less(rb_node_t* a, rb_node_t* b)
+{
+    return (int64_t)(rb_entry(a, task_t, run_node)->vruntime
+               - rb_entry(b, task_t, run_node)->vruntime)
+        < 0;
+}
+
+// gives back the bandwidth of a deadline task, and unpins it
+static void dl_release(task_t* t)
+{
+    if (t->policy != SCHED_DEADLINE)
+        return;
+    lock_wait(&dl_lock);
+    runqueues[t->dl_cpu].dl_bw -= t->dl_bw;
+    lock_release(&dl_lock);
+    t->dl_bw = 0;
+    cpumask_fill(&(t->affinity));
+}
+
+// charges the current task for the time it has been running. vruntime is
+// weighted by priority, and advances at real speed for PRIORITY_MID
+static void update_curr(runqueue_t* rq, timeval_t now)
+{
+    task_t* curr = rq->curr;
+    if (!curr || curr == rq->idle)
+        return;
+
+    uint64_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->sum_runtime += delta;
+    rq->stats.busy_time += delta;
+
+    // there are no system calls, so a user task is only in kernel mode
+    // briefly, in interrupt handlers
+    if (curr->mode == TASK_USER_MODE)
+        curr->acct.utime += delta;
+    else
+        curr->acct.stime += delta;
+    switch (task_class(curr)) {
+    case CLASS_FAIR:
+        curr->vruntime += delta * PRIORITY_MID / curr->priority;
+        break;
+    case CLASS_DL:
+        curr->dl_budget -= delta < curr->dl_budget ? delta : curr->dl_budget;
+        break;
+    case CLASS_RT:
+        curr->slice_left -= delta < curr->slice_left ? delta : curr->slice_left;
+        break;
+    default:
+        break;
     }
 }
 
-// adds to the sleeping tasks list
-static void add_sleeping_sorted(task_t* t)
+// moves min_vruntime up to the smallest vruntime on this cpu
+static void update_min_vruntime(runqueue_t* rq)
 {
-    if (!tasks_asleep.front)
-        tq_push_front(&tasks_asleep, t);
-    else if (tasks_asleep.back->wakeuptime > t->wakeuptime)
-        tq_insert_after(&tasks_asleep, tasks_asleep.back, t);
+    task_t* curr = rq->curr;
+    rb_node_t* first = rb_first(&rq->fair_tree);
+    bool curr_fair = curr && curr->status == TASK_RUNNING && is_fair(curr);
+    if (!first && !curr_fair)
+        return;
+
+    uint64_t v;
+    if (!first)
+        v = curr->vruntime;
     else {
-        for (task_t* i = tasks_asleep.front; i; i = i->next) {
-            if (i->wakeuptime <= t->wakeuptime) {
-                tq_insert_after(&tasks_asleep, i->prev, t);
-                break;
-            }
+        v = rb_entry(first, task_t, run_node)->vruntime;
+        if (curr_fair && (int64_t)(curr->vruntime - v) < 0)
+            v = curr->vruntime;
+    }
+    if ((int64_t)(v - rq->min_vruntime) > 0)
+        rq->min_vruntime = v;
+}
+
+/*
+ * Sets up a task which is coming back from sleep. A fair task gets a
+ * little credit, but it can't use the time it spent asleep to starve the
+ * others. A throttled deadline task starts its next period, and one which
+ * slept past its deadline gets a new one.
+ */
+static void place_woken(runqueue_t* rq, task_t* t, timeval_t now)
+{
+    if (t->policy == SCHED_DEADLINE) {
+        if (t->dl_throttled) {
+            t->dl_throttled = false;
+            t->dl_deadline += t->dl_period;
+            t->dl_budget = t->dl_runtime;
+        }
+        if (t->dl_deadline <= now) {
+            t->dl_deadline = now + t->dl_period;
+            t->dl_budget = t->dl_runtime;
         }
+        return;
     }
+
+    uint64_t floor = rq->min_vruntime - SCHED_SLEEPER_BONUS;
+    if ((int64_t)(t->vruntime - floor) < 0)
+        t->vruntime = floor;
 }
 
-static void add_task(task_t* t)
+static void add_task(runqueue_t* rq, task_t* t)
 {
     if (t->status == TASK_SLEEPING) {
-        add_sleeping_sorted(t);
+        sq_insert(&rq->tasks_asleep, t);
         return;
     }
 
-    switch (t->priority) {
-    case PRIORITY_BG:
-        tq_push_front(&tasks_bg, t);
+    switch (task_class(t)) {
+    case CLASS_DL:
+        rb_insert(&rq->dl_tree, &t->run_node, deadline_less);
+        break;
+    case CLASS_RT:
+        tq_push_front(&rq->rt_queues[t->rt_priority], t);
+        rq->rt_bitmap |= 1U << t->rt_priority;
+        break;
+    case CLASS_FAIR:
+        rb_insert(&rq->fair_tree, &t->run_node, vruntime_less);
+        break;
+    case CLASS_BG:
+        tq_push_front(&rq->tasks_bg, t);
+        break;
+    default:
         return;
-    case PRIORITY_MIN:
-        tq_push_front(&tasks_min, t);
+    }
+    rq->nr_ready++;
+}
+
+// a real-time task which was preempted goes back to the front of its level
+static void add_rt_first(runqueue_t* rq, task_t* t)
+{
+    tqueue_t* q = &rq->rt_queues[t->rt_priority];
+    tq_insert_after(q, q->back, t);
+    rq->rt_bitmap |= 1U << t->rt_priority;
+    rq->nr_ready++;
+}
+
+static task_t* rt_pop(runqueue_t* rq, uint8_t level)
+{
+    task_t* t = tq_pop_back(&rq->rt_queues[level]);
+    if (!rq->rt_queues[level].back)
+        rq->rt_bitmap &= ~(1U << level);
+    return t;
+}
+
+// removes the task which should run next from a run queue
+static task_t* pick_next(runqueue_t* rq)
+{
+    task_t* next;
+
+    // earliest deadline, then the highest real-time level, then the fair
+    // task which has run the least, and finally a background task
+    rb_node_t* first;
+    if ((first = rb_first(&rq->dl_tree))) {
+        rb_erase(&rq->dl_tree, first);
+        next = rb_entry(first, task_t, run_node);
+    } else if (rq->rt_bitmap) {
+        next = rt_pop(rq, 31 - __builtin_clz(rq->rt_bitmap));
+    } else if ((first = rb_first(&rq->fair_tree))) {
+        rb_erase(&rq->fair_tree, first);
+        next = rb_entry(first, task_t, run_node);
+    } else {
+        next = tq_pop_back(&rq->tasks_bg);
+    }
+
+    if (next)
+        rq->nr_ready--;
+    return next;
+}
+
+// number of tasks wanting to run on a cpu, can be called without the lock
+static uint64_t rq_load(runqueue_t* rq)
+{
+    task_t* curr = __atomic_load_n(&rq->curr, __ATOMIC_RELAXED);
+    uint64_t load = __atomic_load_n(&rq->nr_ready, __ATOMIC_RELAXED);
+    return (curr && curr != rq->idle) ? load + 1 : load;
+}
+
+// takes a ready task off its run queue
+static void remove_task(runqueue_t* rq, task_t* t)
+{
+    switch (task_class(t)) {
+    case CLASS_DL:
+        rb_erase(&rq->dl_tree, &t->run_node);
+        break;
+    case CLASS_RT:
+        tq_remove(&rq->rt_queues[t->rt_priority], t);
+        if (!rq->rt_queues[t->rt_priority].back)
+            rq->rt_bitmap &= ~(1U << t->rt_priority);
+        break;
+    case CLASS_FAIR:
+        rb_erase(&rq->fair_tree, &t->run_node);
+        break;
+    default:
+        tq_remove(&rq->tasks_bg, t);
+    }
+    rq->nr_ready--;
+}
+
+// queues a task which is in no queue on another cpu, holding both locks
+static void move_task(runqueue_t* from, runqueue_t* to, task_t* t)
+{
+    // keep its place relative to the others
+    t->vruntime = to->min_vruntime + (t->vruntime - from->min_vruntime);
+    t->last_cpu = to - runqueues;
+    t->nr_migrations++;
+    to->nr_migrations++;
+    add_task(to, t);
+}
+
+// an idle cpu takes any task it may run, a busy one leaves cache-hot ones
+static bool can_pull(task_t* t, uint16_t cpu, timeval_t now, bool idle)
+{
+    if (!cpumask_test(&t->affinity, cpu))
+        return false;
+    return idle || now - t->exec_start >= SCHED_MIGRATION_COST;
+}
+
+// deadline tasks are pinned to the cpu they were admitted on, and so are
+// never pulled
+static task_t* find_pullable(runqueue_t* src, uint16_t cpu, timeval_t now, bool idle)
+{
+    int scanned = 0;
+    for (int l = SCHED_RT_LEVELS - 1; l >= 0 && scanned < SCHED_PULL_SCAN; l--) {
+        if (!(src->rt_bitmap & (1U << l)))
+            continue;
+        for (task_t* t = src->rt_queues[l].back; t && scanned < SCHED_PULL_SCAN; t = t->prev, scanned++)
+            if (can_pull(t, cpu, now, idle))
+                return t;
+    }
+    for (rb_node_t* n = rb_first(&src->fair_tree); n && scanned < SCHED_PULL_SCAN; n = rb_next(n), scanned++) {
+        task_t* t = rb_entry(n, task_t, run_node);
+        if (can_pull(t, cpu, now, idle))
+            return t;
+    }
+    for (task_t* t = src->tasks_bg.back; t && scanned < SCHED_PULL_SCAN; t = t->prev, scanned++)
+        if (can_pull(t, cpu, now, idle))
+            return t;
+    return NULL;
+}
+
+/*
+ * Pulls a ready task from the busiest cpu. If we have nothing to run any
+ * imbalance will do, otherwise it has to be significant. We already hold
+ * our own lock, so we only try the other one to avoid deadlocking with a
+ * cpu pulling from us.
+ */
+static void pull_task(runqueue_t* rq, uint16_t cpu, timeval_t now)
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    runqueue_t* busiest = NULL;
+    uint64_t max_ready = 0;
+
+    for (uint16_t i = 0; i < ncpus; i++) {
+        uint64_t n = __atomic_load_n(&runqueues[i].nr_ready, __ATOMIC_RELAXED);
+        if (i != cpu && runqueues[i].online && n > max_ready) {
+            max_ready = n;
+            busiest = &runqueues[i];
+        }
+    }
+    if (!busiest)
         return;
-    case PRIORITY_MID:
-        tq_push_front(&tasks_mid, t);
+
+    bool idle = !rq->nr_ready;
+    if (!idle && (max_ready < rq->nr_ready + 2 || max_ready * 100 < rq->nr_ready * SCHED_IMBALANCE_PCT))
         return;
-    case PRIORITY_MAX:
-        tq_push_front(&tasks_max, t);
+    if (!lock_try(&busiest->lock))
         return;
+
+    task_t* t = find_pullable(busiest, cpu, now, idle);
+    if (t) {
+        remove_task(busiest, t);
+        move_task(busiest, rq, t);
     }
+    lock_release_try(&busiest->lock);
 }
 
-void _do_context_switch(task_state_t* state)
+// periodic balancing of a busy cpu, run as a softirq
+static void sched_balance()
 {
-    static uint64_t ticks = 0;
-
-    lock_wait(&sched_lock);
     uint16_t cpu = smp_get_current_info()->cpu_id;
+    runqueue_t* rq = &runqueues[cpu];
+    lock_wait(&rq->lock);
+    pull_task(rq, cpu, hpet_get_nanos());
+    lock_release(&rq->lock);
+}
+
+// picks the least loaded cpu a task may run on
+static runqueue_t* select_rq(task_t* t)
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    runqueue_t* best = NULL;
+    uint64_t min_load = UINT64_MAX;
+
+    for (uint16_t i = 0; i < ncpus; i++) {
+        if (!runqueues[i].online || !cpumask_test(&t->affinity, i))
+            continue;
+        uint64_t load = rq_load(&runqueues[i]);
+        if (load < min_load) {
+            min_load = load;
+            best = &runqueues[i];
+        }
+    }
+    return best ? best : &runqueues[smp_get_current_info()->cpu_id];
+}
+
+/*
+ * Picks a cpu for a task which has just become runnable. prev is taken if
+ * it is idle, as its cache may still be warm, then any other idle cpu,
+ * then the one running the least important task the woken one would
+ * preempt. Returns NULL if every cpu is busy with something as important.
+ */
+static runqueue_t* select_wake_rq(task_t* t, runqueue_t* prev)
+{
+    if (prev->online && cpumask_test(&t->affinity, prev - runqueues) && !rq_load(prev))
+        return prev;
+
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    runqueue_t* lowest = NULL;
+    uint32_t min_rank = task_rank(t);
+    for (uint16_t i = 0; i < ncpus; i++) {
+        runqueue_t* rq = &runqueues[i];
+        if (!rq->online || !cpumask_test(&t->affinity, i))
+            continue;
+        if (!rq_load(rq))
+            return rq;
+        uint32_t rank = __atomic_load_n(&rq->curr_rank, __ATOMIC_RELAXED);
+        if (rank < min_rank) {
+            min_rank = rank;
+            lowest = rq;
+        }
+    }
+    return lowest;
+}
+
+static void rq_notify(runqueue_t* rq);
+
+// sends a task which is in no queue to a cpu it may run on. returns false
+// if that cpu was busy, and the task was not queued
+static bool push_task(runqueue_t* rq, task_t* t)
+{
+    runqueue_t* to = select_rq(t);
+    if (to == rq || !lock_try(&to->lock))
+        return false;
+
+    move_task(rq, to, t);
+    rq_notify(to);
+    lock_release_try(&to->lock);
+    return true;
+}
+
+// forces a cpu through the scheduler soon, the timer vector is reused so
+// the usual context switch path handles it
+void sched_kick(uint16_t cpu)
+{
+    uint64_t flags = lock_irq_save();
+    apic_send_ipi(smp_get_info()->cpus[cpu].lapic_id, apic_timer_get_vector(), APIC_IPI_TYPE_FIXED);
+    lock_irq_restore(flags);
+}
+
+// makes a cpu go through the scheduler soon. one waiting in mwait only
+// needs its flag written, anything else gets an ipi
+static void rq_resched(runqueue_t* rq)
+{
+    rq->tick_stopped = false;
+    if (!idle_wake(rq - runqueues))
+        sched_kick(rq - runqueues);
+}
+
+// call after adding work to a run queue, so a cpu without a tick notices it
+static void rq_notify(runqueue_t* rq)
+{
+    if (rq->tick_stopped)
+        rq_resched(rq);
+}
+
+// we have more ready tasks than we can run, wake up an idle cpu to pull one
+static void wake_idle_cpu(uint16_t cpu)
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    for (uint16_t i = 0; i < ncpus; i++) {
+        runqueue_t* rq = &runqueues[i];
+        if (i != cpu && rq->online && rq->tick_stopped && rq->curr == rq->idle) {
+            rq_notify(rq);
+            return;
+        }
+    }
+}
+
+// how long the current task may run before the scheduler has to look
+// again, 0 if it can run until something else happens
+static timeval_t curr_slice(runqueue_t* rq)
+{
+    task_t* curr = rq->curr;
+    switch (task_class(curr)) {
+    case CLASS_DL:
+        return curr->dl_budget ? curr->dl_budget : 1;
+    case CLASS_RT:
+        if (curr->policy == SCHED_FIFO || !rq->rt_queues[curr->rt_priority].back)
+            return 0;
+        return curr->slice_left ? curr->slice_left : 1;
+    case CLASS_IDLE:
+        return 0;
+    default:
+        return rq->nr_ready ? TIMESLICE_DEFAULT : 0;
+    }
+}
+
+/*
+ * Programs the one-shot timer for the next thing this cpu has to do: the
+ * end of the current task's slice if it has one, or else the earliest
+ * wakeup. With a single runnable task or none at all, the tick is stopped.
+ */
+static void rq_program_timer(runqueue_t* rq, timeval_t now)
+{
+    timeval_t slice = curr_slice(rq);
+    bool need_tick = slice != 0;
+    timeval_t next = need_tick ? now + slice : UINT64_MAX;
+
+    task_t* sleeper = sq_peek(&rq->tasks_asleep);
+    if (sleeper && sleeper->wakeuptime < next)
+        next = sleeper->wakeuptime;
+
+    rq->tick_stopped = !need_tick;
+    rq->next_event = next;
+    if (next == UINT64_MAX)
+        apic_timer_oneshot(0);
+    else
+        apic_timer_oneshot(next > now ? next - now : 1);
+}
+
+// switches to the next task, returning once the current one is picked
+// again. from_irq is false when the task called schedule() itself, rather
+// than being preempted. called with interrupts disabled
+static void __schedule(bool from_irq)
+{
+    cpu_t* cpuinfo = smp_get_current_info();
+
+    // the current task has disabled preemption, let it continue
+    if (this_cpu_read(preempt_count)) {
+        // try again later, the tick may have been stopped
+        apic_timer_oneshot(TIMESLICE_DEFAULT);
+        return;
+    }
+
+    uint16_t cpu = cpuinfo->cpu_id;
+    runqueue_t* rq = &runqueues[cpu];
+    lock_wait(&rq->lock);
+
+    // switching tasks is a quiescent state for rcu
+    rcu_note_qs(cpu);
+    idle_clear(cpu, rq->curr == rq->idle);
+    if (from_irq)
+        schedstat_record_irq(&rq->stats, rq->curr == rq->idle);
+
+    // the clock is read only once
+    timeval_t now = hpet_get_nanos();
+    update_curr(rq, now);
 
     // save state of current task, if there is one
-    task_t* curr = tasks_running[cpu];
+    task_t* curr = rq->curr;
+    bool preempted = false;
+    bool wake_janitor = false;
     if (curr) {
-        curr->kstack_top = state;
-        curr->last_tick = ticks;
+        curr->ready_since = now;
+        preempted = from_irq && curr->status == TASK_RUNNING;
 
-        // if the task was running, set it to ready
+        // if the task was running, set it to ready. blocked tasks are
+        // not put back in any queue, dead ones are left for the janitor
         if (curr->status == TASK_RUNNING)
             curr->status = TASK_READY;
-        add_task(curr);
+
+        // a deadline task which used up its budget waits for its next period
+        if (curr->status == TASK_READY && curr->policy == SCHED_DEADLINE && !curr->dl_budget) {
+            curr->dl_throttled = true;
+            curr->status = TASK_SLEEPING;
+            curr->wakeuptime = curr->dl_deadline;
+        }
+
+        // a real-time task which was preempted keeps its place, one which
+        // used up its slice or yielded goes to the back with a new one
+        bool rt_first = false;
+        if (task_class(curr) == CLASS_RT) {
+            rt_first = curr->status == TASK_READY && curr->slice_left;
+            if (!curr->slice_left)
+                curr->slice_left = curr->policy == SCHED_RR ? curr->rr_slice : UINT64_MAX;
+        }
+
+        if (curr->status == TASK_READY || curr->status == TASK_SLEEPING) {
+            if (cpumask_test(&curr->affinity, cpu) || !push_task(rq, curr)) {
+                if (rt_first)
+                    add_rt_first(rq, curr);
+                else
+                    add_task(rq, curr);
+            }
+        } else if (curr->status == TASK_DEAD) {
+            dl_release(curr);
+            lock_wait(&dead_lock);
+            tq_push_front(&tasks_dead, curr);
+            wake_janitor = janitor_asleep;
+            janitor_asleep = false;
+            lock_release(&dead_lock);
+        }
     }
 
     // wake up tasks which need to be woken up
-    while (tasks_asleep.back && tasks_asleep.back->wakeuptime < hpet_get_nanos()) {
-        task_t* t = tq_pop_back(&tasks_asleep);
-        t->status = TASK_READY;
-        add_task(t);
+    update_min_vruntime(rq);
+    task_t* t = sq_peek(&rq->tasks_asleep);
+    if (t && t->wakeuptime < now) {
+        uint64_t begin = rdtsc(), n = 0;
+        while ((t = sq_peek(&rq->tasks_asleep)) && t->wakeuptime < now) {
+            sq_pop(&rq->tasks_asleep);
+            t->status = TASK_READY;
+            t->ready_since = now;
+            t->woken_at = now;
+            place_woken(rq, t, now);
+            add_task(rq, t);
+            n++;
+        }
+        schedstat_record_expiry(&rq->stats, n, rdtsc() - begin);
     }
+    rq->ticks++;
 
-    // next task to run
-    task_t* next = NULL;
+    // if we have nothing to do look for work elsewhere right away, a busy
+    // cpu only does so periodically, and not from the timer interrupt
+    if (!rq->nr_ready)
+        pull_task(rq, cpu, now);
+    else if (rq->ticks % SCHED_BALANCE_TICKS == 0)
+        softirq_raise(SOFTIRQ_SCHED);
 
-    // get tasks from all lists
-    task_t *tmin = tasks_min.back, *tmid = tasks_mid.back, *tmax = tasks_max.back;
+    // next task to run. one whose affinity has changed is sent away, if
+    // that fails it runs here for one more timeslice
+    task_t* next;
+    while ((next = pick_next(rq)) && !cpumask_test(&next->affinity, cpu) && push_task(rq, next))
+        ;
+    if (!next)
+        next = rq->idle;
 
-    // if nothing to execute, grab a background task
-    if (!tmin && !tmid && !tmax) {
-        task_t* tbg = tasks_bg.back;
-        if (!tbg) {
-            next = tasks_idle[cpu];
-        } else {
-            next = tq_pop_back(&tasks_bg);
+    if (next != curr) {
+        if (curr && preempted)
+            curr->nr_involuntary++;
+        else if (curr)
+            curr->nr_voluntary++;
+        if (next != rq->idle) {
+            next->sum_wait += now - next->ready_since;
+            schedstat_record_wait(&rq->stats, now - next->ready_since);
         }
-        goto chosen;
+        if (next->woken_at) {
+            schedstat_record_wakeup(&rq->stats, now - next->woken_at);
+            next->woken_at = 0;
+        }
+        schedstat_record_switch(&rq->stats, now, curr, next);
     }
 
-    // calculate effective priorities
-    uint64_t tminp = tmin ? (tmin->priority + (ticks - tmin->last_tick)) : 0;
-    uint64_t tmidp = tmid ? (tmid->priority + (ticks - tmid->last_tick)) : 0;
-    uint64_t tmaxp = tmax ? (tmax->priority + (ticks - tmax->last_tick)) : 0;
+    next->status = TASK_RUNNING;
+    next->last_cpu = cpu;
+    next->exec_start = now;
+    rq->curr = next;
+    __atomic_store_n(&rq->curr_rank, task_rank(next), __ATOMIC_RELAXED);
+    this_cpu_write(current_task, next);
+
+    rq_program_timer(rq, now);
+    if (rq->nr_ready)
+        wake_idle_cpu(cpu);
 
-    // pop task with highest priority
-    if (tminp > tmidp) {
-        if (tminp > tmaxp)
-            next = tq_pop_back(&tasks_min);
-        else
-            next = tq_pop_back(&tasks_max);
-    } else {
-        if (tmidp > tmaxp)
-            next = tq_pop_back(&tasks_mid);
-        else
-            next = tq_pop_back(&tasks_max);
+    // set the rsp0 in tss
+    cpuinfo->tss.rsp0 = (uint64_t)(next->kstack_limit + KSTACK_SIZE);
+
+    // the kernel half is the same in every address space, so kernel tasks
+    // just borrow the loaded one and the tlb is only flushed when needed
+    if (next->mode == TASK_USER_MODE && next->cr3 != rq->cr3) {
+        write_cr("cr3", next->cr3);
+        rq->cr3 = next->cr3;
+        rq->stats.nr_cr3_loads++;
     }
+    lock_release(&rq->lock);
 
-chosen : {
-    next->status = TASK_RUNNING;
-    tasks_running[cpu] = next;
+    // can't be done with our run queue locked, the janitor may be on it
+    if (wake_janitor)
+        sched_wake(janitor);
 
-    // set the rsp0 in tss
-    smp_get_current_info()->tss.rsp0 = (uint64_t)(next->kstack_limit + KSTACK_SIZE);
-    ticks++;
+    if (next == curr)
+        return;
+
+    // it may have just been switched away from on another cpu
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    next->on_cpu = true;
+    fpu_switch(curr, next, cpu);
+
+    // the boot stack is left behind for good
+    void* boot_sp;
+    if (curr)
+        switch_to(&curr->kstack_top, next->kstack_top, &curr->on_cpu);
+    else
+        switch_to(&boot_sp, next->kstack_top, NULL);
+}
+
+// entered from the timer interrupt, or a reschedule ipi. a preempted task
+// returns through here, and resumes with iretq
+void _do_context_switch(task_state_t* state)
+{
+    (void)state;
+
+    // bottom halves run first, with the timer acknowledged so other
+    // interrupts can come in meanwhile
     apic_send_eoi();
-    lock_release(&sched_lock);
-    finish_context_switch(next);
+    softirq_run();
+    __schedule(true);
 }
+
+// gives up the cpu right now, only the callee-saved registers are kept
+void schedule()
+{
+    uint64_t flags = lock_irq_save();
+    __schedule(false);
+    lock_irq_restore(flags);
 }
 
 void sched_sleep(timeval_t nanos)
@@ -180,52 +813,294 @@ void sched_sleep(timeval_t nanos)
         return;
     }
 
-    lock_wait(&sched_lock);
-    task_t* curr = tasks_running[smp_get_current_info()->cpu_id];
+    runqueue_t* rq = &runqueues[smp_get_current_info()->cpu_id];
+    lock_wait(&rq->lock);
+    task_t* curr = rq->curr;
     curr->wakeuptime = hpet_get_nanos() + nanos;
     curr->status = TASK_SLEEPING;
-    lock_release(&sched_lock);
-    asm volatile("hlt");
+    lock_release(&rq->lock);
+    schedule();
 }
 
 void sched_die()
 {
-    lock_wait(&sched_lock);
-    task_t* curr = tasks_running[smp_get_current_info()->cpu_id];
-    curr->status = TASK_DEAD;
-    tq_push_front(&tasks_dead, curr);
-    lock_release(&sched_lock);
+    runqueue_t* rq = &runqueues[smp_get_current_info()->cpu_id];
+    lock_wait(&rq->lock);
+    rq->curr->status = TASK_DEAD;
+    lock_release(&rq->lock);
+    schedule();
+
+    // never scheduled again
+    while (true)
+        asm volatile("hlt");
+}
+
+// blocks the current task and releases l (which must be held).
+// returns once sched_wake() has been called on the task
+void sched_block(lock_t* l)
+{
+    runqueue_t* rq = &runqueues[smp_get_current_info()->cpu_id];
+    lock_wait(&rq->lock);
+    task_t* curr = rq->curr;
+    curr->status = TASK_BLOCKED;
+    lock_release(&rq->lock);
+    lock_release(l);
+
+    // if we were woken up in between, we are just put back in the queue
+    schedule();
+}
+
+// gives up the cpu to the other ready tasks
+void sched_yield()
+{
+    runqueue_t* rq = &runqueues[smp_get_current_info()->cpu_id];
+    lock_wait(&rq->lock);
+
+    // a real-time task goes to the back of its level
+    task_t* curr = rq->curr;
+    if (task_class(curr) == CLASS_RT)
+        curr->slice_left = 0;
+
+    // make sure a fair task goes after the ones waiting
+    rb_node_t* first = rb_first(&rq->fair_tree);
+    if (first && is_fair(curr)) {
+        uint64_t v = rb_entry(first, task_t, run_node)->vruntime;
+        if ((int64_t)(curr->vruntime - v) < 0)
+            curr->vruntime = v;
+    }
+    lock_release(&rq->lock);
+    schedule();
+}
+
+// should a task woken on this cpu run before the current one
+static bool wakeup_preempts(runqueue_t* rq, task_t* t)
+{
+    task_t* curr = rq->curr;
+    if (!curr)
+        return true;
+
+    sched_class_t tc = task_class(t), cc = task_class(curr);
+    if (tc != cc)
+        return tc > cc;
+    switch (tc) {
+    case CLASS_DL:
+        return t->dl_deadline < curr->dl_deadline;
+    case CLASS_RT:
+        return t->rt_priority > curr->rt_priority;
+    case CLASS_FAIR:
+        return (int64_t)(curr->vruntime - t->vruntime) > (int64_t)SCHED_WAKEUP_GRAN;
+    default:
+        return false;
+    }
+}
+
+// call after queueing a woken or new task, so its cpu switches to it
+// right away if it should run first
+static void notify_woken(runqueue_t* rq, task_t* t)
+{
+    if (wakeup_preempts(rq, t))
+        rq_resched(rq);
+    else
+        rq_notify(rq);
+}
+
+// makes a blocked task runnable again, on the cpu it last ran on unless
+// another one can run it sooner
+void sched_wake(task_t* t)
+{
+    // a blocked task can't migrate, so last_cpu is stable
+    runqueue_t* rq = &runqueues[t->last_cpu];
+    lock_wait(&rq->lock);
+    if (t->status == TASK_BLOCKED) {
+        // if it has not given up its cpu yet, just let it continue
+        if (rq->curr == t) {
+            t->status = TASK_RUNNING;
+        } else {
+            timeval_t now = hpet_get_nanos();
+            update_curr(rq, now);
+            update_min_vruntime(rq);
+            t->status = TASK_READY;
+            t->ready_since = now;
+            t->woken_at = now;
+            place_woken(rq, t, now);
 
-    // wait for scheduler
-    asm volatile("hlt");
+            // the other cpu is left alone if it is busy with its own lock
+            runqueue_t* to = select_wake_rq(t, rq);
+            if (to && to != rq && lock_try(&to->lock)) {
+                move_task(rq, to, t);
+                to->stats.nr_wake_migrations++;
+                notify_woken(to, t);
+                lock_release_try(&to->lock);
+            } else {
+                add_task(rq, t);
+                notify_woken(rq, t);
+            }
+        }
+    }
+    lock_release(&rq->lock);
 }
 
 void sched_add(task_t* t)
 {
-    lock_wait(&sched_lock);
-    add_task(t);
-    lock_release(&sched_lock);
+    runqueue_t* rq = select_wake_rq(t, &runqueues[smp_get_current_info()->cpu_id]);
+    if (!rq)
+        rq = select_rq(t);
+    lock_wait(&rq->lock);
+    timeval_t now = hpet_get_nanos();
+    update_curr(rq, now);
+    update_min_vruntime(rq);
+    t->ready_since = now;
+    t->woken_at = now;
+    t->vruntime = rq->min_vruntime;
+    t->last_cpu = rq - runqueues;
+    add_task(rq, t);
+    notify_woken(rq, t);
+    lock_release(&rq->lock);
+}
+
+// a queued or running task is moved the next time its cpu schedules
+void sched_set_affinity(task_t* t, const cpumask_t* mask)
+{
+    uint16_t cpu = t->last_cpu;
+    runqueue_t* rq = &runqueues[cpu];
+    lock_wait(&rq->lock);
+    t->affinity = *mask;
+    lock_release(&rq->lock);
+
+    if (!cpumask_test(mask, cpu))
+        sched_kick(cpu);
+}
+
+// number of tasks moved to a cpu from others
+uint64_t sched_get_migrations(uint16_t cpu)
+{
+    return __atomic_load_n(&runqueues[cpu].nr_migrations, __ATOMIC_RELAXED);
+}
+
+// tasks running or ready to run, on all cpus
+uint64_t sched_get_nr_running()
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    uint64_t n = 0;
+    for (uint16_t i = 0; i < ncpus; i++)
+        if (runqueues[i].online)
+            n += rq_load(&runqueues[i]);
+    return n;
+}
+
+/*
+ * Sets the scheduling policy of a task which has not been added yet, or
+ * of the current task. Normal tasks are placed by their priority, and
+ * real-time ones by rt_priority. rr_slice is the round-robin timeslice,
+ * or 0 for the default.
+ */
+int sched_set_policy(task_t* t, sched_policy_t policy, uint8_t rt_priority, timeval_t rr_slice)
+{
+    if (policy == SCHED_DEADLINE || rt_priority >= SCHED_RT_LEVELS)
+        return -1;
+
+    dl_release(t);
+    runqueue_t* rq = &runqueues[t->last_cpu];
+    lock_wait(&rq->lock);
+    t->policy = policy;
+    t->rt_priority = rt_priority;
+    t->rr_slice = rr_slice ? rr_slice : SCHED_RR_SLICE;
+    t->slice_left = policy == SCHED_RR ? t->rr_slice : UINT64_MAX;
+    lock_release(&rq->lock);
+    return 0;
+}
+
+/*
+ * Makes a task which has not been added yet, or the current task, a
+ * deadline task. It gets runtime every period, and must be done by the end
+ * of the period. It is admitted on the first cpu which has room for it and
+ * stays there, so the cpu's deadline tasks can always meet their deadlines.
+ */
+int sched_set_deadline(task_t* t, timeval_t runtime, timeval_t period)
+{
+    if (!runtime || runtime > period)
+        return -1;
+    uint64_t bw = (runtime << SCHED_DL_BW_SHIFT) / period;
+
+    dl_release(t);
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    int cpu = -1;
+    lock_wait(&dl_lock);
+    for (uint16_t i = 0; i < ncpus; i++) {
+        if (runqueues[i].online && runqueues[i].dl_bw + bw <= SCHED_DL_BW_MAX) {
+            runqueues[i].dl_bw += bw;
+            cpu = i;
+            break;
+        }
+    }
+    lock_release(&dl_lock);
+    if (cpu < 0) {
+        klog_warn("could not admit deadline task %d\n", t->tid);
+        return -1;
+    }
+
+    uint16_t from = t->last_cpu;
+    runqueue_t* rq = &runqueues[from];
+    lock_wait(&rq->lock);
+    t->policy = SCHED_DEADLINE;
+    t->dl_runtime = runtime;
+    t->dl_period = period;
+    t->dl_bw = bw;
+    t->dl_cpu = cpu;
+    t->dl_deadline = hpet_get_nanos() + period;
+    t->dl_budget = runtime;
+    t->dl_throttled = false;
+    cpumask_zero(&(t->affinity));
+    cpumask_set(&(t->affinity), cpu);
+    lock_release(&rq->lock);
+
+    // get it off a cpu it may no longer run on, like sched_set_affinity
+    if (from != cpu)
+        sched_kick(from);
+    return 0;
+}
+
+const schedstat_cpu_t* sched_get_stats(uint16_t cpu)
+{
+    return &runqueues[cpu].stats;
 }
 
-task_t* sched_get_current()
+// copies up to n of the most recent switch events on a cpu, oldest first
+size_t sched_trace_read(uint16_t cpu, sched_event_t* buf, size_t n)
 {
-    return tasks_running[smp_get_current_info()->cpu_id];
+    runqueue_t* rq = &runqueues[cpu];
+    lock_wait(&rq->lock);
+    uint64_t total = rq->stats.nr_events;
+    uint64_t avail = total < SCHEDSTAT_TRACE_LEN ? total : SCHEDSTAT_TRACE_LEN;
+    if (n > avail)
+        n = avail;
+    for (size_t i = 0; i < n; i++)
+        buf[i] = rq->stats.trace[(total - n + i) % SCHEDSTAT_TRACE_LEN];
+    lock_release(&rq->lock);
+    return n;
 }
 
 void sched_init(void (*entry)(tid_t))
 {
-    uint16_t cpu_id = smp_get_current_info()->cpu_id;
-    tasks_idle[cpu_id] = task_make(idle, PRIORITY_IDLE, TASK_KERNEL_MODE, NULL, 0);
+    runqueue_t* rq = &runqueues[smp_get_current_info()->cpu_id];
+    rq->idle = task_make(idle, PRIORITY_IDLE, TASK_KERNEL_MODE, NULL, 0);
+    rq->stats.online_since = hpet_get_nanos();
+    read_cr("cr3", &rq->cr3);
+    rq->online = true;
+    softirq_register(SOFTIRQ_SCHED, sched_balance);
 
     // scheduler has been started on the bsp
     if (entry) {
+        idle_init();
         task_add(entry, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
-        task_add(sched_janitor, PRIORITY_MIN, TASK_KERNEL_MODE, NULL, 0);
+        janitor = task_make(sched_janitor, PRIORITY_MIN, TASK_KERNEL_MODE, NULL, 0);
+        sched_add(janitor);
         klog_ok("started on bsp\n");
     }
 
-    apic_timer_set_period(TIMESLICE_DEFAULT);
-    apic_timer_set_mode(APIC_TIMER_MODE_PERIODIC);
+    // the timer is reprogrammed on every switch, start with one timeslice
+    apic_timer_set_mode(APIC_TIMER_MODE_ONESHOT);
     apic_timer_set_handler(init_context_switch);
     apic_timer_start();
+    apic_timer_oneshot(TIMESLICE_DEFAULT);
 }
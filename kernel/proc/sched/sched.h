@@ -2,9 +2,52 @@
 
 #include "../task.h"
 #include "lib/time.h"
+#include "lock.h"
+#include "sys/smp/smp.h"
+#include <stddef.h>
+
+// number of real-time priority levels
+#define SCHED_RT_LEVELS 32
+
+// round-robin timeslice, if none is given
+#define SCHED_RR_SLICE MILLIS_TO_NANOS(10)
+
+// fixed point shift for deadline task bandwidth, and the most that may be
+// reserved on one cpu, leaving some time for everything else
+#define SCHED_DL_BW_SHIFT 20
+#define SCHED_DL_BW_MAX ((95ULL << SCHED_DL_BW_SHIFT) / 100)
 
 void sched_add(task_t* task);
 void sched_init(void (*entry)(tid_t));
 void sched_sleep(timeval_t nanos);
 void sched_die();
-task_t* sched_get_current();
+void sched_block(lock_t* l);
+void sched_yield();
+void schedule();
+void sched_wake(task_t* t);
+void sched_kick(uint16_t cpu);
+void sched_set_affinity(task_t* t, const cpumask_t* mask);
+uint64_t sched_get_migrations(uint16_t cpu);
+uint64_t sched_get_nr_running();
+int sched_set_policy(task_t* t, sched_policy_t policy, uint8_t rt_priority, timeval_t rr_slice);
+int sched_set_deadline(task_t* t, timeval_t runtime, timeval_t period);
+
+DECLARE_PER_CPU(task_t*, current_task);
+DECLARE_PER_CPU(uint32_t, preempt_count); // current task can't be preempted if nonzero
+
+static inline task_t* sched_get_current()
+{
+    return this_cpu_read(current_task);
+}
+
+// while preemption is disabled, the timer will not switch away from the
+// current task. these nest, and must not be held across a sleep
+static inline void preempt_disable()
+{
+    this_cpu_inc(preempt_count);
+}
+
+static inline void preempt_enable()
+{
+    this_cpu_dec(preempt_count);
+}
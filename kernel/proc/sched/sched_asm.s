@@ -1,5 +1,6 @@
 .global init_context_switch
-.global finish_context_switch
+.global switch_to
+.global restore_state
 
 .extern _do_context_switch
 
@@ -23,13 +24,36 @@ init_context_switch:
     mov %rsp, %rdi
     call _do_context_switch
 
-    // context switch failed for whatever reason, clean up and return
-    add $120, %rsp
-    iretq
+    // the task was not switched away from, or has just been resumed
+    jmp restore_state
+
+// switch_to(prev_sp, next_sp, prev_on_cpu) keeps only the callee-saved
+// registers, the rest were saved by the caller or the interrupt. next
+// returns from its own call to this, or new tasks start in restore_state
+switch_to:
+    push %rbx
+    push %rbp
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+    mov %rsp, (%rdi)
+    mov %rsi, %rsp
 
-finish_context_switch:
-    mov (%rdi), %rsp
+    // we are off the previous task's stack, other cpus may run it now
+    test %rdx, %rdx
+    jz 1f
+    movb $0, (%rdx)
+1:
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %rbp
+    pop %rbx
+    ret
 
+restore_state:
     pop %r15
     pop %r14
     pop %r13
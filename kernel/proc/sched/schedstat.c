@@ -0,0 +1,382 @@
+#include "schedstat.h"
+#include "klog.h"
+#include "memutils.h"
+#include "sched.h"
+#include "semaphore.h"
+#include "sys/hpet.h"
+#include "sys/smp/smp.h"
+
+// switch events shown per cpu by sched_dumpstats()
+#define SCHEDSTAT_DUMP_EVENTS 8
+
+static void dump_task(const char* what, task_t* t)
+{
+    klog_printf(" \t \t  %s tid %d: run %d us, wait %d us, %d voluntary, %d involuntary, %d migrations\n",
+        what, t->tid, NANOS_TO_MICROS(t->sum_runtime), NANOS_TO_MICROS(t->sum_wait),
+        t->nr_voluntary, t->nr_involuntary, t->nr_migrations);
+}
+
+void sched_dumpstats()
+{
+    static sched_event_t events[SCHEDSTAT_DUMP_EVENTS];
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    timeval_t now = hpet_get_nanos();
+    uint64_t hist[SCHEDSTAT_LAT_BUCKETS] = { 0 };
+    uint64_t wake_hist[SCHEDSTAT_LAT_BUCKETS] = { 0 };
+
+    klog_info("scheduler statistics\n");
+    for (uint16_t i = 0; i < ncpus; i++) {
+        const schedstat_cpu_t* s = sched_get_stats(i);
+        timeval_t up = now - s->online_since;
+        klog_printf(" \t \tcpu %d: %d%% busy, %d switches, %d migrations in, %d woken here from elsewhere, %d cr3 loads/s, %d interrupts, %d while idle\n", i,
+            up ? s->busy_time * 100 / up : 0, s->nr_switches, sched_get_migrations(i),
+            s->nr_wake_migrations, up ? s->nr_cr3_loads * SECONDS_TO_NANOS(1) / up : 0,
+            s->nr_irqs, s->nr_idle_irqs);
+        for (int b = 0; b < SCHEDSTAT_LAT_BUCKETS; b++) {
+            hist[b] += s->lat_hist[b];
+            wake_hist[b] += s->wake_hist[b];
+        }
+
+        size_t n = sched_trace_read(i, events, SCHEDSTAT_DUMP_EVENTS);
+        for (size_t e = 0; e < n; e++)
+            klog_printf(" \t \t  %d us: %d -> %d\n", NANOS_TO_MICROS(events[e].time),
+                events[e].prev, events[e].next);
+    }
+    dump_task("current", sched_get_current());
+
+    klog_printf(" \t \trun queue latency:\n");
+    for (int b = 0; b < SCHEDSTAT_LAT_BUCKETS; b++)
+        if (hist[b])
+            klog_printf(" \t \t  < %d us: %d\n", 1 << b, hist[b]);
+    klog_printf(" \t \twakeup to first run:\n");
+    for (int b = 0; b < SCHEDSTAT_LAT_BUCKETS; b++)
+        if (wake_hist[b])
+            klog_printf(" \t \t  < %d us: %d\n", 1 << b, wake_hist[b]);
+    klog_printf("\n");
+}
+
+static semaphore_t bench_done;
+static uint32_t bench_tasks;
+static uint32_t bench_ready;
+static uint32_t bench_finished;
+static timeval_t bench_start;
+static timeval_t bench_end;
+
+// yields to its partner, which is on the same cpu and does the same
+static void pingpong(tid_t tid)
+{
+    (void)tid;
+    __atomic_add_fetch(&bench_ready, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&bench_ready, __ATOMIC_SEQ_CST) < bench_tasks)
+        sched_yield();
+
+    // the first one to get here starts the clock, the last one stops it
+    timeval_t zero = 0;
+    __atomic_compare_exchange_n(&bench_start, &zero, hpet_get_nanos(), false,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    for (int i = 0; i < SCHEDSTAT_BENCH_YIELDS; i++)
+        sched_yield();
+    if (__atomic_add_fetch(&bench_finished, 1, __ATOMIC_SEQ_CST) == bench_tasks)
+        __atomic_store_n(&bench_end, hpet_get_nanos(), __ATOMIC_RELAXED);
+
+    sem_post(&bench_done);
+    sched_die();
+}
+
+// runs a ping-pong pair on each of the first n cpus, returns the time
+// until all of them were done
+static timeval_t pingpong_run(uint16_t n)
+{
+    sem_init(&bench_done, 0);
+    bench_tasks = 2 * n;
+    bench_ready = 0;
+    bench_finished = 0;
+    bench_start = 0;
+
+    for (uint32_t i = 0; i < bench_tasks; i++) {
+        task_t* t = task_make(pingpong, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+        if (!t)
+            return 0;
+        cpumask_zero(&(t->affinity));
+        cpumask_set(&(t->affinity), i / 2);
+        sched_add(t);
+    }
+    for (uint32_t i = 0; i < bench_tasks; i++)
+        sem_wait(&bench_done);
+    return bench_end - bench_start;
+}
+
+// pairs of tasks on 1, 2, 4... cpus switch to each other. the time per
+// switch, and how the total switch rate grows with cpus, are logged
+void sched_benchmark()
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    uint64_t switches = 2 * SCHEDSTAT_BENCH_YIELDS;
+
+    klog_info("ping-pong, %d switches per cpu\n", switches);
+    for (uint16_t n = 1;; n = n * 2 < ncpus ? n * 2 : ncpus) {
+        timeval_t t = pingpong_run(n);
+        if (!t)
+            return;
+        uint64_t total = n * switches;
+        if (n == 1)
+            klog_printf(" \t \t%d ns per switch\n", t / switches);
+        klog_printf(" \t \t%d cpus: %d switches/s\n", n, total * SECONDS_TO_NANOS(1) / t);
+        if (n == ncpus)
+            break;
+    }
+    klog_printf("\n");
+}
+
+// wake latencies seen by one periodic task
+typedef struct {
+    uint64_t hist[SCHEDSTAT_LAT_BUCKETS];
+    timeval_t max;
+} rt_bench_t;
+
+static rt_bench_t rt_bench[SCHEDSTAT_RT_BENCH_TASKS];
+static uint32_t rt_bench_next;
+
+// upper bound, in us, of the bucket the pct'th percentile falls in
+static uint64_t hist_percentile(const uint64_t* hist, uint64_t total, uint64_t pct)
+{
+    uint64_t seen = 0;
+    for (int b = 0; b < SCHEDSTAT_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen * 100 >= total * pct)
+            return 1ULL << b;
+    }
+    return 1ULL << (SCHEDSTAT_LAT_BUCKETS - 1);
+}
+
+// sleeps until the start of each period, and records how late it woke up
+static void rt_periodic(tid_t tid)
+{
+    (void)tid;
+    rt_bench_t* b = &rt_bench[__atomic_fetch_add(&rt_bench_next, 1, __ATOMIC_RELAXED)];
+    timeval_t next = hpet_get_nanos();
+    for (int i = 0; i < SCHEDSTAT_RT_BENCH_LOOPS; i++) {
+        next += SCHEDSTAT_RT_BENCH_PERIOD;
+        timeval_t now = hpet_get_nanos();
+        if (next > now)
+            sched_sleep(next - now);
+        now = hpet_get_nanos();
+        timeval_t lat = now > next ? now - next : 0;
+        schedstat_hist_add(b->hist, lat);
+        if (lat > b->max)
+            b->max = lat;
+    }
+
+    sem_post(&bench_done);
+    sched_die();
+}
+
+static void rt_bench_run(const char* name, sched_policy_t policy)
+{
+    memset(rt_bench, 0, sizeof(rt_bench));
+    rt_bench_next = 0;
+    sem_init(&bench_done, 0);
+
+    int started = 0;
+    for (int i = 0; i < SCHEDSTAT_RT_BENCH_TASKS; i++) {
+        task_t* t = task_make(rt_periodic, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+        if (!t)
+            break;
+        if (policy == SCHED_DEADLINE)
+            sched_set_deadline(t, SCHEDSTAT_RT_BENCH_PERIOD / 4, SCHEDSTAT_RT_BENCH_PERIOD);
+        else
+            sched_set_policy(t, policy, SCHED_RT_LEVELS - 1, 0);
+        sched_add(t);
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+        sem_wait(&bench_done);
+
+    uint64_t hist[SCHEDSTAT_LAT_BUCKETS] = { 0 };
+    timeval_t max = 0;
+    for (int i = 0; i < started; i++) {
+        for (int b = 0; b < SCHEDSTAT_LAT_BUCKETS; b++)
+            hist[b] += rt_bench[i].hist[b];
+        if (rt_bench[i].max > max)
+            max = rt_bench[i].max;
+    }
+    uint64_t total = started * SCHEDSTAT_RT_BENCH_LOOPS;
+    klog_printf(" \t \t%s: %d wakeups, p50 < %d us, p99 < %d us, max %d us\n", name, total,
+        hist_percentile(hist, total, 50), hist_percentile(hist, total, 99), NANOS_TO_MICROS(max));
+}
+
+// periodic tasks of each real-time class wake up at the start of every
+// period, and the percentiles of how late they were are logged
+void sched_rt_benchmark()
+{
+    klog_info("real-time wake latency, %d tasks with a %d us period\n",
+        SCHEDSTAT_RT_BENCH_TASKS, NANOS_TO_MICROS(SCHEDSTAT_RT_BENCH_PERIOD));
+    rt_bench_run("fifo", SCHED_FIFO);
+    rt_bench_run("deadline", SCHED_DEADLINE);
+    klog_printf("\n");
+}
+
+static timeval_t sleep_bench_base;
+static uint32_t sleep_bench_next;
+static uint32_t sleep_bench_early;
+static timeval_t sleep_bench_late;
+
+// sleeps until its own deadline, and checks it was not woken before it
+static void sleeper(tid_t tid)
+{
+    (void)tid;
+    uint32_t i = __atomic_fetch_add(&sleep_bench_next, 1, __ATOMIC_RELAXED);
+    timeval_t deadline = sleep_bench_base + i * SCHEDSTAT_SLEEP_BENCH_STAGGER;
+    timeval_t now = hpet_get_nanos();
+    if (deadline > now)
+        sched_sleep(deadline - now);
+
+    now = hpet_get_nanos();
+    if (now < deadline) {
+        __atomic_add_fetch(&sleep_bench_early, 1, __ATOMIC_RELAXED);
+    } else {
+        timeval_t late = __atomic_load_n(&sleep_bench_late, __ATOMIC_RELAXED);
+        while (now - deadline > late
+            && !__atomic_compare_exchange_n(&sleep_bench_late, &late, now - deadline, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    sem_post(&bench_done);
+    sched_die();
+}
+
+static void expiry_totals(uint64_t* runs, uint64_t* expired, uint64_t* cycles)
+{
+    *runs = *expired = *cycles = 0;
+    for (uint16_t i = 0; i < smp_get_info()->num_cpus; i++) {
+        const schedstat_cpu_t* s = sched_get_stats(i);
+        *runs += s->nr_expiry_runs;
+        *expired += s->nr_expired;
+        *cycles += s->expiry_cycles;
+    }
+}
+
+/*
+ * Many tasks go to sleep at once, each due a little after the one
+ * before. The time spent waking them up, per tick that found any due and
+ * per task, is logged, and so is any task which woke up too early.
+ */
+void sched_sleep_benchmark()
+{
+    uint64_t runs, expired, cycles;
+    expiry_totals(&runs, &expired, &cycles);
+    sem_init(&bench_done, 0);
+    sleep_bench_base = hpet_get_nanos() + SCHEDSTAT_SLEEP_BENCH_DELAY;
+    sleep_bench_next = 0;
+    sleep_bench_early = 0;
+    sleep_bench_late = 0;
+
+    int started = 0;
+    for (; started < SCHEDSTAT_SLEEP_BENCH_TASKS; started++) {
+        task_t* t = task_make(sleeper, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+        if (!t)
+            break;
+        sched_add(t);
+    }
+    for (int i = 0; i < started; i++)
+        sem_wait(&bench_done);
+
+    uint64_t r, e, c;
+    expiry_totals(&r, &e, &c);
+    runs = r - runs;
+    expired = e - expired;
+    cycles = c - cycles;
+    klog_info("%d sleepers %d us apart: %d woke early, at most %d us late\n", started,
+        NANOS_TO_MICROS(SCHEDSTAT_SLEEP_BENCH_STAGGER), sleep_bench_early,
+        NANOS_TO_MICROS(sleep_bench_late));
+    klog_printf(" \t \t%d ticks woke %d tasks, %d cycles per tick, %d per task\n\n", runs,
+        expired, runs ? cycles / runs : 0, expired ? cycles / expired : 0);
+}
+
+/*
+ * Leaves the system idle for a while, and logs how many timer and
+ * reschedule interrupts each cpu took per second of idle time. With the
+ * tick stopped, only timers which are actually due should come in.
+ */
+void sched_idle_selftest()
+{
+    static uint64_t irqs[CPU_MAX];
+    static timeval_t busy[CPU_MAX];
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    for (uint16_t i = 0; i < ncpus; i++) {
+        irqs[i] = sched_get_stats(i)->nr_idle_irqs;
+        busy[i] = sched_get_stats(i)->busy_time;
+    }
+    timeval_t start = hpet_get_nanos();
+    sched_sleep(SCHEDSTAT_IDLE_TEST_TIME);
+    timeval_t t = hpet_get_nanos() - start;
+
+    klog_info("interrupts while idle for %d ms\n", NANOS_TO_MILLIS(t));
+    for (uint16_t i = 0; i < ncpus; i++) {
+        const schedstat_cpu_t* s = sched_get_stats(i);
+        timeval_t b = s->busy_time - busy[i];
+        timeval_t idle = t > b ? t - b : 0;
+        klog_printf(" \t \tcpu %d: %d interrupts, %d/s idle\n", i, s->nr_idle_irqs - irqs[i],
+            idle ? (s->nr_idle_irqs - irqs[i]) * SECONDS_TO_NANOS(1) / idle : 0);
+    }
+    klog_printf("\n");
+}
+
+static semaphore_t wake_ping;
+static semaphore_t wake_pong;
+static timeval_t wake_posted;
+static uint64_t wake_test_hist[SCHEDSTAT_LAT_BUCKETS];
+static timeval_t wake_test_max;
+
+// waits to be woken, and records how long it took to get running
+static void wake_waiter(tid_t tid)
+{
+    (void)tid;
+    for (int i = 0; i < SCHEDSTAT_WAKE_TEST_ROUNDS; i++) {
+        sem_wait(&wake_ping);
+        timeval_t lat = hpet_get_nanos() - __atomic_load_n(&wake_posted, __ATOMIC_ACQUIRE);
+        schedstat_hist_add(wake_test_hist, lat);
+        if (lat > wake_test_max)
+            wake_test_max = lat;
+        sem_post(&wake_pong);
+    }
+
+    sem_post(&bench_done);
+    sched_die();
+}
+
+// a task on the last cpu is woken over and over, each time after its
+// cpu has gone idle, and the histogram of post to run latency is logged
+void sched_wake_selftest()
+{
+    uint16_t cpu = smp_get_info()->num_cpus - 1;
+    sem_init(&bench_done, 0);
+    sem_init(&wake_ping, 0);
+    sem_init(&wake_pong, 0);
+    memset(wake_test_hist, 0, sizeof(wake_test_hist));
+    wake_test_max = 0;
+
+    task_t* t = task_make(wake_waiter, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+    if (!t)
+        return;
+    cpumask_zero(&(t->affinity));
+    cpumask_set(&(t->affinity), cpu);
+    sched_add(t);
+
+    for (int i = 0; i < SCHEDSTAT_WAKE_TEST_ROUNDS; i++) {
+        __atomic_store_n(&wake_posted, hpet_get_nanos(), __ATOMIC_RELEASE);
+        sem_post(&wake_ping);
+        sem_wait(&wake_pong);
+    }
+    sem_wait(&bench_done);
+
+    uint64_t total = SCHEDSTAT_WAKE_TEST_ROUNDS;
+    klog_info("wake to run on cpu %d: p50 < %d us, p99 < %d us, max %d us\n", cpu,
+        hist_percentile(wake_test_hist, total, 50), hist_percentile(wake_test_hist, total, 99),
+        NANOS_TO_MICROS(wake_test_max));
+    for (int b = 0; b < SCHEDSTAT_LAT_BUCKETS; b++)
+        if (wake_test_hist[b])
+            klog_printf(" \t \t  < %d us: %d\n", 1 << b, wake_test_hist[b]);
+    klog_printf("\n");
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "../task.h"
+#include "lib/time.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// run queue latency histogram, bucket i counts waits below 2^i us
+#define SCHEDSTAT_LAT_BUCKETS 16
+
+// recent context switches kept per cpu
+#define SCHEDSTAT_TRACE_LEN 256
+
+// yields each sched_benchmark() task makes, there are two per cpu
+#define SCHEDSTAT_BENCH_YIELDS 50000
+
+// periodic tasks of each real-time class started by sched_rt_benchmark(),
+// how often they wake up, and how many times
+#define SCHEDSTAT_RT_BENCH_TASKS 2
+#define SCHEDSTAT_RT_BENCH_PERIOD MILLIS_TO_NANOS(2)
+#define SCHEDSTAT_RT_BENCH_LOOPS 500
+
+// sleepers started by sched_sleep_benchmark(), the first one's wakeup
+// time, and the gap between one wakeup time and the next
+#define SCHEDSTAT_SLEEP_BENCH_TASKS 2000
+#define SCHEDSTAT_SLEEP_BENCH_DELAY MILLIS_TO_NANOS(100)
+#define SCHEDSTAT_SLEEP_BENCH_STAGGER MICROS_TO_NANOS(50)
+
+// how long sched_idle_selftest() leaves the system idle
+#define SCHEDSTAT_IDLE_TEST_TIME MILLIS_TO_NANOS(500)
+
+// wakeups of an idle cpu's task timed by sched_wake_selftest()
+#define SCHEDSTAT_WAKE_TEST_ROUNDS 1000
+
+// a context switch, as recorded in the trace ring
+typedef struct {
+    timeval_t time;
+    tid_t prev;
+    tid_t next;
+    uint8_t prev_status; // tstatus_t of prev after the switch
+} sched_event_t;
+
+// per-cpu scheduler statistics, updated under the run queue lock
+typedef struct {
+    timeval_t online_since;
+    timeval_t busy_time; // time spent running tasks other than idle
+    uint64_t nr_switches;
+    uint64_t nr_irqs; // timer and reschedule interrupts
+    uint64_t nr_idle_irqs; // the ones which came in while idle
+    uint64_t nr_cr3_loads; // address space switches
+    uint64_t lat_hist[SCHEDSTAT_LAT_BUCKETS];
+    uint64_t wake_hist[SCHEDSTAT_LAT_BUCKETS]; // wakeup to first run, same buckets
+    uint64_t nr_wake_migrations; // woken tasks sent here from the cpu they last ran on
+    uint64_t nr_expiry_runs; // times sleeping tasks were found due
+    uint64_t nr_expired; // sleeping tasks woken up when due
+    uint64_t expiry_cycles; // tsc cycles spent waking them up
+    uint64_t nr_events; // total events recorded, the ring holds the last few
+    sched_event_t trace[SCHEDSTAT_TRACE_LEN];
+} schedstat_cpu_t;
+
+static inline void schedstat_hist_add(uint64_t* hist, timeval_t t)
+{
+    uint64_t us = NANOS_TO_MICROS(t);
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    hist[b < SCHEDSTAT_LAT_BUCKETS ? b : SCHEDSTAT_LAT_BUCKETS - 1]++;
+}
+
+// time a task waited in the run queue before it was picked
+static inline void schedstat_record_wait(schedstat_cpu_t* s, timeval_t wait)
+{
+    schedstat_hist_add(s->lat_hist, wait);
+}
+
+// time from a task becoming runnable to it first running
+static inline void schedstat_record_wakeup(schedstat_cpu_t* s, timeval_t lat)
+{
+    schedstat_hist_add(s->wake_hist, lat);
+}
+
+static inline void schedstat_record_irq(schedstat_cpu_t* s, bool idle)
+{
+    s->nr_irqs++;
+    if (idle)
+        s->nr_idle_irqs++;
+}
+
+// n sleeping tasks were woken up in one go, taking some cycles
+static inline void schedstat_record_expiry(schedstat_cpu_t* s, uint64_t n, uint64_t cycles)
+{
+    s->nr_expiry_runs++;
+    s->nr_expired += n;
+    s->expiry_cycles += cycles;
+}
+
+static inline void schedstat_record_switch(schedstat_cpu_t* s, timeval_t now, task_t* prev, task_t* next)
+{
+    sched_event_t* e = &s->trace[s->nr_events % SCHEDSTAT_TRACE_LEN];
+    e->time = now;
+    e->prev = prev ? prev->tid : 0;
+    e->next = next->tid;
+    e->prev_status = prev ? prev->status : TASK_DEAD;
+    s->nr_events++;
+    s->nr_switches++;
+}
+
+const schedstat_cpu_t* sched_get_stats(uint16_t cpu);
+size_t sched_trace_read(uint16_t cpu, sched_event_t* buf, size_t n);
+void sched_dumpstats();
+void sched_benchmark();
+void sched_rt_benchmark();
+void sched_sleep_benchmark();
+void sched_idle_selftest();
+void sched_wake_selftest();
@@ -0,0 +1,68 @@
+#include "sleepq.h"
+
+// joins two heaps, the later one becomes the first child of the other
+static task_t* meld(task_t* a, task_t* b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (b->wakeuptime < a->wakeuptime) {
+        task_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->next = a->prev;
+    a->prev = b;
+    return a;
+}
+
+// melds a list of siblings into one heap
+static task_t* merge_pairs(task_t* first)
+{
+    // meld them in pairs from the left, collecting the results in reverse
+    task_t* pairs = NULL;
+    while (first) {
+        task_t* a = first;
+        task_t* b = a->next;
+        first = b ? b->next : NULL;
+        a->next = NULL;
+        if (b)
+            b->next = NULL;
+
+        task_t* m = meld(a, b);
+        m->next = pairs;
+        pairs = m;
+    }
+
+    // then meld the pairs together, the last one first
+    task_t* root = NULL;
+    while (pairs) {
+        task_t* n = pairs->next;
+        pairs->next = NULL;
+        root = meld(root, pairs);
+        pairs = n;
+    }
+    return root;
+}
+
+void sq_insert(sleepq_t* q, task_t* t)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    q->root = meld(q->root, t);
+    q->len++;
+}
+
+task_t* sq_pop(sleepq_t* q)
+{
+    task_t* ret = q->root;
+    if (!ret)
+        return NULL;
+
+    q->root = merge_pairs(ret->prev);
+    q->len--;
+    ret->next = NULL;
+    ret->prev = NULL;
+    return ret;
+}
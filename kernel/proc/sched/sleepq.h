@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../task.h"
+#include <stddef.h>
+
+/*
+ * Sleeping tasks ordered by wakeup time, as a pairing heap. Inserting is
+ * O(1) and removing the earliest is O(log n) amortized. A sleeping task
+ * is in no other queue, so its next and prev links are reused for the
+ * heap: next points to its sibling and prev to its first child.
+ */
+typedef struct {
+    task_t* root;
+    uint64_t len;
+} sleepq_t;
+
+void sq_insert(sleepq_t* q, task_t* t);
+task_t* sq_pop(sleepq_t* q);
+
+// the task which wakes up first
+static inline task_t* sq_peek(sleepq_t* q)
+{
+    return q->root;
+}
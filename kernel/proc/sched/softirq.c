@@ -0,0 +1,72 @@
+#include "softirq.h"
+#include "lock.h"
+#include "sched.h"
+#include "sys/smp/smp.h"
+#include "workqueue.h"
+#include <stdbool.h>
+
+typedef struct {
+    uint32_t pending; // bitmap of raised softirqs
+    bool running; // an outer interrupt is already running them
+    work_t overflow; // runs the rest from the worker, if there are too many
+    uint64_t nr_run[SOFTIRQ_MAX];
+} __attribute__((aligned(64))) softirq_cpu_t;
+
+static softirq_cpu_t softirq_cpus[CPU_MAX];
+static void (*handlers[SOFTIRQ_MAX])();
+
+void softirq_register(softirq_t nr, void (*handler)())
+{
+    handlers[nr] = handler;
+}
+
+void softirq_raise(softirq_t nr)
+{
+    softirq_cpu_t* s = &softirq_cpus[smp_get_current_info()->cpu_id];
+    __atomic_fetch_or(&s->pending, 1U << nr, __ATOMIC_RELAXED);
+}
+
+static void softirq_work(work_t* w)
+{
+    (void)w;
+    softirq_run();
+}
+
+// called on interrupt exit, and by the worker if they kept being raised
+void softirq_run()
+{
+    uint64_t flags = lock_irq_save();
+    softirq_cpu_t* s = &softirq_cpus[smp_get_current_info()->cpu_id];
+    if (s->running || !s->pending) {
+        lock_irq_restore(flags);
+        return;
+    }
+
+    s->running = true;
+    preempt_disable();
+    for (int restart = 0; s->pending && restart < SOFTIRQ_MAX_RESTART; restart++) {
+        uint32_t pending = __atomic_exchange_n(&s->pending, 0, __ATOMIC_RELAXED);
+        asm volatile("sti");
+        for (int nr = 0; nr < SOFTIRQ_MAX; nr++) {
+            if (!(pending & (1U << nr)) || !handlers[nr])
+                continue;
+            handlers[nr]();
+            s->nr_run[nr]++;
+        }
+        asm volatile("cli");
+    }
+    preempt_enable();
+    s->running = false;
+
+    // don't hold up the interrupted task any longer
+    if (s->pending) {
+        s->overflow.func = softirq_work;
+        work_queue(&s->overflow);
+    }
+    lock_irq_restore(flags);
+}
+
+uint64_t softirq_get_count(uint16_t cpu, softirq_t nr)
+{
+    return softirq_cpus[cpu].nr_run[nr];
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// bottom halves, lower numbers run first
+typedef enum {
+    SOFTIRQ_SCHED, // periodic load balancing
+    SOFTIRQ_MAX
+} softirq_t;
+
+// times the pending ones are rerun on interrupt exit before the rest is
+// handed to the worker
+#define SOFTIRQ_MAX_RESTART 4
+
+/*
+ * Raised from interrupt handlers, and run when the interrupt returns
+ * with interrupts enabled but preemption disabled. Handlers must not
+ * sleep, and only ever run on the cpu that raised them.
+ */
+void softirq_register(softirq_t nr, void (*handler)());
+void softirq_raise(softirq_t nr);
+void softirq_run();
+uint64_t softirq_get_count(uint16_t cpu, softirq_t nr);
@@ -50,3 +50,17 @@ task_t* tq_find(tqueue_t* q, tid_t tid)
             return t;
     return NULL;
 }
+
+void tq_remove(tqueue_t* q, task_t* t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        q->front = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        q->back = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
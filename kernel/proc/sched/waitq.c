@@ -0,0 +1,32 @@
+#include "waitq.h"
+#include "sched.h"
+
+/*
+ * All of these must be called with wq->lock held. The waker changes the
+ * condition being waited for before taking the lock, and the sleeper
+ * checks it after taking the lock, so no wakeup can be lost.
+ */
+
+// puts the current task to sleep on wq, returns with wq->lock held again
+void waitq_sleep(waitq_t* wq)
+{
+    tq_push_front(&wq->waiters, sched_get_current());
+    sched_block(&wq->lock);
+    lock_wait(&wq->lock);
+}
+
+// wakes the task that has been waiting the longest
+bool waitq_wake_one(waitq_t* wq)
+{
+    task_t* t = tq_pop_back(&wq->waiters);
+    if (!t)
+        return false;
+    sched_wake(t);
+    return true;
+}
+
+void waitq_wake_all(waitq_t* wq)
+{
+    while (waitq_wake_one(wq))
+        ;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "lock.h"
+#include "tqueue.h"
+
+// a queue of tasks blocked on some event
+typedef struct {
+    lock_t lock;
+    tqueue_t waiters;
+} waitq_t;
+
+void waitq_sleep(waitq_t* wq);
+bool waitq_wake_one(waitq_t* wq);
+void waitq_wake_all(waitq_t* wq);
@@ -0,0 +1,126 @@
+#include "workqueue.h"
+#include "klog.h"
+#include "lock.h"
+#include "sched.h"
+#include "softirq.h"
+#include "sys/hpet.h"
+#include "sys/smp/smp.h"
+
+typedef struct {
+    lock_t lock;
+    work_t* front;
+    work_t* back;
+    task_t* worker;
+    bool worker_asleep; // worker is blocked, the next item wakes it
+    wq_stats_t stats;
+} __attribute__((aligned(64))) workqueue_t;
+
+static workqueue_t workqueues[CPU_MAX];
+static bool online;
+
+_Noreturn static void worker(tid_t tid)
+{
+    (void)tid;
+
+    // pinned, so this stays our queue
+    workqueue_t* wq = &workqueues[smp_get_current_info()->cpu_id];
+    lock_wait(&wq->lock);
+    while (true) {
+        work_t* w;
+        while ((w = wq->front)) {
+            wq->front = w->next;
+            if (!wq->front)
+                wq->back = NULL;
+            wq->stats.depth--;
+
+            timeval_t latency = hpet_get_nanos() - w->queued_at;
+            wq->stats.nr_executed++;
+            wq->stats.sum_latency += latency;
+            if (latency > wq->stats.max_latency)
+                wq->stats.max_latency = latency;
+
+            // it may queue itself again once it has started
+            __atomic_store_n(&w->pending, false, __ATOMIC_RELEASE);
+            lock_release(&wq->lock);
+            w->func(w);
+            lock_wait(&wq->lock);
+        }
+        wq->worker_asleep = true;
+        sched_block(&wq->lock);
+        lock_wait(&wq->lock);
+    }
+}
+
+// starts a worker on every cpu
+void workqueue_init()
+{
+    const smp_info_t* info = smp_get_info();
+    for (uint16_t i = 0; i < info->num_cpus; i++) {
+        task_t* t = task_make(worker, PRIORITY_MAX, TASK_KERNEL_MODE, NULL, 0);
+        if (!t)
+            continue;
+        cpumask_zero(&(t->affinity));
+        cpumask_set(&(t->affinity), i);
+        workqueues[i].worker = t;
+        sched_add(t);
+    }
+    __atomic_store_n(&online, true, __ATOMIC_RELEASE);
+    klog_ok("%d workers started\n", info->num_cpus);
+}
+
+// before this, deferred work would never run
+bool workqueue_online()
+{
+    return __atomic_load_n(&online, __ATOMIC_ACQUIRE);
+}
+
+// returns false if the work was already pending
+bool work_queue_on(uint16_t cpu, work_t* w)
+{
+    if (__atomic_exchange_n(&w->pending, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    workqueue_t* wq = &workqueues[cpu];
+    lock_wait(&wq->lock);
+    w->next = NULL;
+    w->queued_at = hpet_get_nanos();
+    if (wq->back)
+        wq->back->next = w;
+    else
+        wq->front = w;
+    wq->back = w;
+    if (++wq->stats.depth > wq->stats.max_depth)
+        wq->stats.max_depth = wq->stats.depth;
+
+    bool wake = wq->worker_asleep;
+    wq->worker_asleep = false;
+    lock_release(&wq->lock);
+
+    if (wake)
+        sched_wake(wq->worker);
+    return true;
+}
+
+bool work_queue(work_t* w)
+{
+    return work_queue_on(smp_get_current_info()->cpu_id, w);
+}
+
+const wq_stats_t* workqueue_get_stats(uint16_t cpu)
+{
+    return &workqueues[cpu].stats;
+}
+
+void workqueue_dumpstats()
+{
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    klog_info("deferred work statistics\n");
+    for (uint16_t i = 0; i < ncpus; i++) {
+        const wq_stats_t* s = workqueue_get_stats(i);
+        klog_printf(" \t \tcpu %d: %d run, depth %d (max %d), latency avg %d us, max %d us, %d balance softirqs\n", i,
+            s->nr_executed, s->depth, s->max_depth,
+            s->nr_executed ? NANOS_TO_MICROS(s->sum_latency / s->nr_executed) : 0,
+            NANOS_TO_MICROS(s->max_latency), softirq_get_count(i, SOFTIRQ_SCHED));
+    }
+    klog_printf("\n");
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../task.h"
+#include "lib/time.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// embedded in whatever the deferred work operates on
+typedef struct work_t {
+    struct work_t* next;
+    void (*func)(struct work_t* work);
+    timeval_t queued_at;
+    bool pending; // queued and not yet started
+} work_t;
+
+// per-cpu work queue statistics
+typedef struct {
+    uint64_t depth; // items queued right now
+    uint64_t max_depth;
+    uint64_t nr_executed;
+    timeval_t sum_latency; // from being queued to being started
+    timeval_t max_latency;
+} wq_stats_t;
+
+/*
+ * Work is run by a kernel task on the cpu it was queued on, so it may
+ * sleep and take mutexes. Queueing is safe from interrupt handlers, but
+ * not from inside the scheduler with a run queue locked.
+ */
+static inline void work_init(work_t* w, void (*func)(work_t*))
+{
+    w->next = NULL;
+    w->func = func;
+    w->pending = false;
+}
+
+void workqueue_init();
+bool workqueue_online();
+bool work_queue(work_t* w);
+bool work_queue_on(uint16_t cpu, work_t* w);
+const wq_stats_t* workqueue_get_stats(uint16_t cpu);
+void workqueue_dumpstats();
@@ -1,26 +1,98 @@
 #include "task.h"
+#include "klog.h"
 #include "kmalloc.h"
+#include "rcu.h"
 #include "sched/sched.h"
+#include "sched/tqueue.h"
+#include "semaphore.h"
 #include "sys/cpu/cpu.h"
+#include "sys/cpu/fpu.h"
+#include "sys/hpet.h"
+#include "sys/smp/smp.h"
+#include "tid.h"
 #include <stddef.h>
 
-// highest used tid
-static tid_t curr_tid = 0;
+extern void restore_state();
+
+// dead tasks kept for reuse, along with their kernel stacks
+typedef struct {
+    lock_t lock;
+    tqueue_t tasks;
+    uint64_t nr_tasks;
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64))) task_cache_t;
+
+static task_cache_t task_caches[CPU_MAX];
+
+// puts everything but the stack frame back to its defaults
+static void task_reset(task_t* t)
+{
+    t->vruntime = 0;
+    t->exec_start = 0;
+    t->status = TASK_READY;
+    t->last_cpu = 0;
+    t->on_cpu = false;
+    cpumask_fill(&(t->affinity));
+    t->nr_migrations = 0;
+    t->sum_runtime = 0;
+    t->sum_wait = 0;
+    t->ready_since = 0;
+    t->woken_at = 0;
+    t->nr_voluntary = 0;
+    t->nr_involuntary = 0;
+    t->policy = SCHED_NORMAL;
+    t->rt_priority = 0;
+    t->rr_slice = 0;
+    t->slice_left = 0;
+    t->dl_runtime = 0;
+    t->dl_period = 0;
+    t->dl_bw = 0;
+    t->dl_cpu = 0;
+    t->dl_deadline = 0;
+    t->dl_budget = 0;
+    t->dl_throttled = false;
+    t->fpu_state = NULL;
+    t->fpu_cpu = UINT16_MAX;
+    t->acct = (task_acct_t) { 0 };
+    t->wakeuptime = 0;
+}
+
+// take a clean task from this cpu's cache, or allocate a new one
+static task_t* task_alloc()
+{
+    task_cache_t* c = &task_caches[smp_get_current_info()->cpu_id];
+    lock_wait(&c->lock);
+    task_t* t = tq_pop_back(&c->tasks);
+    if (t) {
+        c->nr_tasks--;
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+    lock_release(&c->lock);
+    if (t)
+        return t;
+
+    t = kmalloc(sizeof(task_t));
+    t->kstack_limit = kstack_alloc();
+    task_reset(t);
+    vec_init(t->openfiles);
+    return t;
+}
 
 task_t* task_make(void (*entry)(tid_t), priority_t priority, tmode_t mode, void* rsp, uint64_t pagemap)
 {
-    // could not allocate a tid
-    if (curr_tid == TID_MAX) {
+    tid_t tid = tid_alloc();
+    if (tid == TID_MAX) {
         klog_warn("could not allocate tid\n");
         return NULL;
     }
 
-    // allocate memory for the new task and its stack
-    task_t* ntask = kmalloc(sizeof(task_t));
-    ntask->kstack_limit = kmalloc(KSTACK_SIZE);
+    task_t* ntask = task_alloc();
     ntask->kstack_top = ntask->kstack_limit + KSTACK_SIZE;
 
-    // create the stack frame and update the state to defaults
+    // create the stack frame
     task_state_t* ntask_state = ntask->kstack_top - sizeof(task_state_t);
     if (mode == TASK_KERNEL_MODE) {
         ntask_state->cs = KMODE_CS;
@@ -32,26 +104,60 @@ task_t* task_make(void (*entry)(tid_t), priority_t priority, tmode_t mode, void*
     ntask_state->rflags = RFLAGS_DEFAULT;
     ntask_state->rip = (uint64_t)entry;
     ntask_state->rsp = rsp ? (uint64_t)rsp : (uint64_t)ntask->kstack_top;
-    ntask_state->rdi = curr_tid; // pass the tid to the task
+    ntask_state->rdi = tid; // pass the tid to the task
 
-    // initialize the task
+    // initialize the task, the rest was reset when it was freed
     if (pagemap)
         ntask->cr3 = pagemap;
     else
         read_cr("cr3", &(ntask->cr3));
 
-    ntask->kstack_top = ntask_state;
-    ntask->tid = curr_tid;
+    // the first switch to it "returns" into the interrupt return path
+    switch_frame_t* frame = (switch_frame_t*)ntask_state - 1;
+    frame->rbp = 0;
+    frame->rip = (uint64_t)restore_state;
+
+    ntask->kstack_top = frame;
+    ntask->tid = tid;
     ntask->priority = priority;
-    ntask->last_tick = 0;
-    ntask->status = TASK_READY;
-    ntask->wakeuptime = 0;
-    vec_init(ntask->openfiles);
+    ntask->mode = mode;
 
-    curr_tid++;
+    tid_set(tid, ntask);
     return ntask;
 }
 
+// hides a dead task from lookups by tid, before it can be freed
+void task_unpublish(task_t* t)
+{
+    tid_set(t->tid, NULL);
+}
+
+// frees a dead task, or keeps it for reuse on the cpu it died on,
+// a grace period after it was unpublished
+void task_free(task_t* t)
+{
+    tid_free(t->tid);
+    fpu_task_free(t);
+    t->openfiles.len = 0;
+
+    task_cache_t* c = &task_caches[t->last_cpu];
+    lock_wait(&c->lock);
+    if (c->nr_tasks < TASK_CACHE_MAX) {
+        task_reset(t);
+        tq_push_front(&c->tasks, t);
+        c->nr_tasks++;
+        t = NULL;
+    }
+    lock_release(&c->lock);
+
+    if (t) {
+        if (t->openfiles.data)
+            kmfree(t->openfiles.data);
+        kstack_free(t->kstack_limit);
+        kmfree(t);
+    }
+}
+
 int task_add(void (*entry)(tid_t), priority_t priority, tmode_t mode, void* rsp, uint64_t pagemap)
 {
     task_t* t = task_make(entry, priority, mode, rsp, pagemap);
@@ -61,3 +167,109 @@ int task_add(void (*entry)(tid_t), priority_t priority, tmode_t mode, void* rsp,
     }
     return -1;
 }
+
+static semaphore_t bench_exited;
+
+static void bench_child(tid_t tid)
+{
+    (void)tid;
+    sem_post(&bench_exited);
+    sched_die();
+}
+
+static void task_cache_getstats(uint64_t* hits, uint64_t* misses)
+{
+    *hits = *misses = 0;
+    for (int i = 0; i < CPU_MAX; i++) {
+        *hits += __atomic_load_n(&task_caches[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&task_caches[i].misses, __ATOMIC_RELAXED);
+    }
+}
+
+// times the id work done for every spawn and exit, with a lookup of our
+// own id for comparison
+static void bench_tids()
+{
+    tid_t self = sched_get_current()->tid;
+    uint64_t flags = lock_irq_save();
+    uint64_t sink = 0;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < TASK_BENCH_TID_CALLS; i++) {
+        tid_t tid = tid_alloc();
+        if (tid != TID_MAX)
+            tid_free(tid);
+    }
+    uint64_t alloc_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    rcu_read_lock();
+    for (int i = 0; i < TASK_BENCH_TID_CALLS; i++)
+        sink += (uint64_t)tid_lookup(self);
+    rcu_read_unlock();
+    uint64_t lookup_cycles = rdtsc() - start;
+
+    lock_irq_restore(flags);
+    asm volatile("" ::"r"(sink));
+    klog_printf(" \t \ttid_alloc + tid_free: %d cycles, tid_lookup: %d cycles, %d tids in use\n",
+        alloc_cycles / TASK_BENCH_TID_CALLS, lookup_cycles / TASK_BENCH_TID_CALLS, tid_get_used());
+}
+
+// spawns short-lived tasks on cpu 0 in batches, and logs how many were
+// spawned and exited per second, how often the caches were hit, and what
+// allocating and looking up task ids costs
+void task_benchmark()
+{
+    task_t* curr = sched_get_current();
+    cpumask_t mask;
+    cpumask_zero(&mask);
+    cpumask_set(&mask, 0);
+    sched_set_affinity(curr, &mask);
+    while (smp_get_current_info()->cpu_id != 0)
+        sched_yield();
+    sem_init(&bench_exited, 0);
+
+    uint64_t task_hits, task_misses, stack_hits, stack_misses;
+    task_cache_getstats(&task_hits, &task_misses);
+    kstack_getstats(&stack_hits, &stack_misses);
+
+    // ids are only freed once the janitor gets to them, so we may run out
+    uint64_t spawned = 0, retries = 0;
+    timeval_t start = hpet_get_nanos();
+    for (int i = 0; i < TASK_BENCH_SPAWNS; i += TASK_BENCH_BATCH) {
+        int n = 0;
+        while (n < TASK_BENCH_BATCH) {
+            task_t* t = task_make(bench_child, PRIORITY_MID, TASK_KERNEL_MODE, NULL, 0);
+            if (!t) {
+                retries++;
+                sched_yield();
+                continue;
+            }
+            t->affinity = mask;
+            sched_add(t);
+            n++;
+        }
+        spawned += n;
+        while (n--)
+            sem_wait(&bench_exited);
+    }
+    timeval_t t = hpet_get_nanos() - start;
+
+    uint64_t hits, misses;
+    task_cache_getstats(&hits, &misses);
+    task_hits = hits - task_hits;
+    task_misses = misses - task_misses;
+    kstack_getstats(&hits, &misses);
+    stack_hits = hits - stack_hits;
+    stack_misses = misses - stack_misses;
+
+    klog_info("spawned %d tasks in %d ms, %d tasks/s, %d retries\n", spawned,
+        NANOS_TO_MILLIS(t), t ? spawned * SECONDS_TO_NANOS(1) / t : 0, retries);
+    klog_printf(" \t \ttask cache: %d hits, %d misses, stack cache: %d hits, %d misses\n",
+        task_hits, task_misses, stack_hits, stack_misses);
+    bench_tids();
+    klog_printf("\n");
+
+    cpumask_fill(&mask);
+    sched_set_affinity(curr, &mask);
+}
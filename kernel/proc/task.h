@@ -1,6 +1,9 @@
 #pragma once
 
 #include "fs/vfs/vfs.h"
+#include "mm/kstack.h"
+#include "rbtree.h"
+#include "sys/smp/cpumask.h"
 #include "time.h"
 #include "vector.h"
 #include <stdbool.h>
@@ -12,7 +15,15 @@
 #define UMODE_SS 0x23
 #define RFLAGS_DEFAULT 0x0202
 
-#define KSTACK_SIZE 4096
+// dead tasks each cpu keeps around for reuse
+#define TASK_CACHE_MAX 32
+
+// tasks spawned by task_benchmark(), and how many are alive at once
+#define TASK_BENCH_SPAWNS 100000
+#define TASK_BENCH_BATCH 64
+
+// tid allocations and lookups timed by task_benchmark()
+#define TASK_BENCH_TID_CALLS 100000
 
 typedef uint16_t tid_t;
 #define TID_MAX UINT16_MAX
@@ -29,10 +40,18 @@ typedef enum {
     TASK_USER_MODE
 } tmode_t;
 
+typedef enum {
+    SCHED_NORMAL, // fair or background class, depending on priority
+    SCHED_FIFO, // real-time, runs until it blocks or yields
+    SCHED_RR, // real-time, round-robin within its level
+    SCHED_DEADLINE // earliest deadline first, with a runtime budget per period
+} sched_policy_t;
+
 typedef enum {
     TASK_READY,
     TASK_RUNNING,
     TASK_SLEEPING,
+    TASK_BLOCKED,
     TASK_DEAD
 } tstatus_t;
 
@@ -59,14 +78,71 @@ typedef struct {
     uint64_t ss;
 } task_state_t;
 
+// what switch_to() leaves on the stack of a task it switched away from
+typedef struct {
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t rbp;
+    uint64_t rbx;
+    uint64_t rip;
+} switch_frame_t;
+
+// resources used by a task, see proc/acct.h
+typedef struct {
+    timeval_t utime; // time spent running in user mode
+    timeval_t stime; // time spent running in kernel mode
+    uint64_t pages_alloc; // pages allocated by pmm_get(), and so kmalloc()
+    uint64_t pages_freed;
+    uint64_t bytes_read; // through vfs_read()
+    uint64_t bytes_written; // through vfs_write()
+    uint64_t nr_handles; // open vfs handles
+} task_acct_t;
+
 typedef struct task_t {
-    void* kstack_top; // kernel stack top
+    void* kstack_top; // saved stack pointer, at a switch_frame_t
     uint64_t cr3; // virtual address space
 
     tid_t tid; // task id
     priority_t priority; // task priority
-    uint64_t last_tick; // last tick at which task ran
+    sched_policy_t policy; // scheduling class
+    uint64_t vruntime; // weighted time spent running, in nanoseconds
+    timeval_t exec_start; // time at which task's runtime was last accounted
     tstatus_t status; // current status of task
+    uint16_t last_cpu; // cpu on which task last ran, or is queued on
+    bool on_cpu; // a cpu is still using its stack
+    cpumask_t affinity; // cpus the task may run on
+    uint64_t nr_migrations; // times moved to another cpu
+
+    // statistics
+    timeval_t sum_runtime; // total time spent running
+    timeval_t sum_wait; // total time spent ready but not running
+    timeval_t ready_since; // time at which it was last queued
+    timeval_t woken_at; // time it last became runnable, 0 once it has run
+    uint64_t nr_voluntary; // times it gave up the cpu itself
+    uint64_t nr_involuntary; // times it was preempted
+
+    // real-time classes
+    uint8_t rt_priority; // higher runs first, below SCHED_RT_LEVELS
+    timeval_t rr_slice; // round-robin timeslice
+    timeval_t slice_left; // left of the current slice, 0 sends it to the back
+
+    // deadline class
+    timeval_t dl_runtime; // runtime allowed per period
+    timeval_t dl_period;
+    uint64_t dl_bw; // runtime / period, reserved on dl_cpu
+    uint16_t dl_cpu; // cpu the task was admitted on
+    timeval_t dl_deadline; // end of the current period
+    timeval_t dl_budget; // runtime left in the current period
+    bool dl_throttled; // used up its budget, waiting for the next period
+
+    // fpu/sse/avx state
+    void* fpu_state; // saved state, NULL until the task first uses the fpu
+    uint16_t fpu_cpu; // cpu whose registers last held its state
+
+    task_acct_t acct; // resource accounting
+
     timeval_t wakeuptime; // time at which task should wake up
     tmode_t mode; // kernel mode or usermode
     void* kstack_limit; // kernel stack limit
@@ -74,7 +150,11 @@ typedef struct task_t {
 
     struct task_t* next;
     struct task_t* prev;
+    rb_node_t run_node; // in the fair class run queue
 } task_t;
 
 task_t* task_make(void (*entrypoint)(tid_t), priority_t priority, tmode_t mode, void* rsp, uint64_t pagemap);
 int task_add(void (*entry)(tid_t), priority_t priority, tmode_t mode, void* rsp, uint64_t pagemap);
+void task_unpublish(task_t* t);
+void task_free(task_t* t);
+void task_benchmark();
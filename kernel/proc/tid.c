@@ -0,0 +1,100 @@
+/*
+    Task id allocation, and lookup of tasks by id.
+
+    Free ids are found in a bitmap, searching onwards from the last one
+    handed out, so a freed id is only reused after all the others have
+    been. Lookups go through a two-level table without taking any lock,
+    under rcu_read_lock(). A dead task is removed from the table first,
+    and its id only freed after a grace period, so a reader never sees
+    an id pointing at a task which has been recycled.
+*/
+#include "tid.h"
+#include "kmalloc.h"
+#include "lock.h"
+#include "memutils.h"
+#include "rcu.h"
+
+static lock_t tid_lock;
+static uint64_t tid_bitmap[TID_BITMAP_WORDS] = {
+    [TID_BITMAP_WORDS - 1] = 1ULL << 63 // TID_MAX
+};
+static uint64_t tid_next; // where the next search starts
+static uint64_t tid_used;
+
+static task_t** tid_table[TID_CHUNKS];
+
+// returns TID_MAX if every id is in use
+tid_t tid_alloc()
+{
+    lock_wait(&tid_lock);
+    if (tid_used == TID_MAX) {
+        lock_release(&tid_lock);
+        return TID_MAX;
+    }
+
+    // the word holding the hint is looked at twice, once from the hint
+    // onwards and once more from its start after wrapping around
+    uint64_t w = tid_next / 64;
+    uint64_t bits = tid_bitmap[w] | ((1ULL << (tid_next % 64)) - 1);
+    for (uint64_t i = 0; ~bits == 0 && i < TID_BITMAP_WORDS; i++) {
+        w = (w + 1) % TID_BITMAP_WORDS;
+        bits = tid_bitmap[w];
+    }
+
+    uint64_t tid = w * 64 + __builtin_ctzll(~bits);
+    tid_bitmap[w] |= 1ULL << (tid % 64);
+    tid_used++;
+
+    tid_next = (tid + 1) % TID_MAX;
+    lock_release(&tid_lock);
+    return tid;
+}
+
+// the task must have been removed from the table a grace period ago
+void tid_free(tid_t tid)
+{
+    lock_wait(&tid_lock);
+    tid_bitmap[tid / 64] &= ~(1ULL << (tid % 64));
+    tid_used--;
+    lock_release(&tid_lock);
+}
+
+// publishes a task under its id, or removes it if t is NULL
+void tid_set(tid_t tid, task_t* t)
+{
+    task_t** chunk = tid_table[tid >> TID_CHUNK_SHIFT];
+    if (!chunk) {
+        if (!t)
+            return;
+
+        // allocated outside the lock, someone else may beat us to it
+        task_t** nchunk = kmalloc(TID_CHUNK_SIZE * sizeof(task_t*));
+        memset(nchunk, 0, TID_CHUNK_SIZE * sizeof(task_t*));
+        lock_wait(&tid_lock);
+        chunk = tid_table[tid >> TID_CHUNK_SHIFT];
+        if (!chunk) {
+            rcu_assign_pointer(tid_table[tid >> TID_CHUNK_SHIFT], nchunk);
+            chunk = nchunk;
+            nchunk = NULL;
+        }
+        lock_release(&tid_lock);
+        if (nchunk)
+            kmfree(nchunk);
+    }
+    rcu_assign_pointer(chunk[tid & (TID_CHUNK_SIZE - 1)], t);
+}
+
+// must be called under rcu_read_lock(), the task stays valid until after
+// rcu_read_unlock() but may already be dead
+task_t* tid_lookup(tid_t tid)
+{
+    task_t** chunk = rcu_dereference(tid_table[tid >> TID_CHUNK_SHIFT]);
+    if (!chunk)
+        return NULL;
+    return rcu_dereference(chunk[tid & (TID_CHUNK_SIZE - 1)]);
+}
+
+uint64_t tid_get_used()
+{
+    return __atomic_load_n(&tid_used, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "task.h"
+#include <stdint.h>
+
+// words in the allocation bitmap, TID_MAX itself is never handed out
+#define TID_BITMAP_WORDS ((TID_MAX + 1) / 64)
+
+// the tid -> task table is split into chunks, allocated when first used
+#define TID_CHUNK_SHIFT 8
+#define TID_CHUNK_SIZE (1 << TID_CHUNK_SHIFT)
+#define TID_CHUNKS ((TID_MAX + 1) / TID_CHUNK_SIZE)
+
+tid_t tid_alloc();
+void tid_free(tid_t tid);
+void tid_set(tid_t tid, task_t* t);
+task_t* tid_lookup(tid_t tid);
+uint64_t tid_get_used();
@@ -12,6 +12,7 @@
 #define APIC_SPURIOUS_VECTOR_NUM 0xFF
 #define APIC_FLAG_ENABLE (1 << 8)
 
+#define APIC_IPI_TYPE_FIXED 0b000
 #define APIC_IPI_TYPE_INIT 0b101
 #define APIC_IPI_TYPE_STARTUP 0b110
 
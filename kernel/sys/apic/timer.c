@@ -45,6 +45,24 @@ void apic_timer_set_period(timeval_t tv)
     apic_timer_set_frequency(freq);
 }
 
+// fire once after tv nanoseconds, or never if tv is 0.
+// the timer must be in one-shot mode
+void apic_timer_oneshot(timeval_t tv)
+{
+    if (!tv) {
+        apic_write_reg(APIC_REG_TIMER_ICR, 0);
+        return;
+    }
+
+    // longer waits just fire early, this keeps the product in 64 bits
+    if (tv > SECONDS_TO_NANOS(1))
+        tv = SECONDS_TO_NANOS(1);
+    uint64_t count = tv * (base_freq / divisor) / 1000000000;
+    if (count > UINT32_MAX)
+        count = UINT32_MAX;
+    apic_write_reg(APIC_REG_TIMER_ICR, count ? count : 1);
+}
+
 uint8_t apic_timer_get_vector()
 {
     return vector;
@@ -24,4 +24,5 @@ void apic_timer_set_handler(void (*h)(void*));
 void apic_timer_set_frequency(uint64_t freq);
 void apic_timer_set_period(timeval_t tv);
 void apic_timer_set_mode(apic_timer_mode_t mode);
+void apic_timer_oneshot(timeval_t tv);
 uint8_t apic_timer_get_vector();
@@ -1,5 +1,6 @@
 #include "cpu.h"
 #include "cpuid.h"
+#include "fpu.h"
 
 uint64_t rdmsr(uint32_t msr)
 {
@@ -57,5 +58,6 @@ void cpu_features_init()
     vcr4 |= 1 << 10;
     write_cr("cr4", vcr4);
 
-    // we do not have any support for saving state yet :(
+    // enable xsave, state is switched lazily by the fpu code
+    fpu_cpu_init();
 }
@@ -31,6 +31,15 @@
 #define MSR_PAT 0x0277
 #define MSR_GS_BASE 0xC0000101
 
+// read the timestamp counter
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc"
+                 : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 void cpu_features_init();
 void wrmsr(uint32_t msr, uint64_t val);
 uint64_t rdmsr(uint32_t msr);
@@ -18,13 +18,17 @@ typedef struct {
 static const cpuid_feature_t CPUID_FEATURE_SSE1 = { .func = 0x00000001, .reg = CPUID_REG_EDX, .mask = 1 << 25 };
 static const cpuid_feature_t CPUID_FEATURE_SSE2 = { .func = 0x00000001, .reg = CPUID_REG_EDX, .mask = 1 << 26 };
 static const cpuid_feature_t CPUID_FEATURE_SSE3 = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 0 };
+static const cpuid_feature_t CPUID_FEATURE_MONITOR = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 3 };
 static const cpuid_feature_t CPUID_FEATURE_SSSE3 = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 9 };
 static const cpuid_feature_t CPUID_FEATURE_SSE41 = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 19 };
 static const cpuid_feature_t CPUID_FEATURE_SSE42 = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 20 };
 static const cpuid_feature_t CPUID_FEATURE_POPCNT = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 23 };
 static const cpuid_feature_t CPUID_FEATURE_AVX = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 28 };
 static const cpuid_feature_t CPUID_FEATURE_PAT = { .func = 0x00000001, .reg = CPUID_REG_EDX, .mask = 1 << 16 };
+static const cpuid_feature_t CPUID_FEATURE_XSAVE = { .func = 0x00000001, .reg = CPUID_REG_ECX, .mask = 1 << 26 };
+static const cpuid_feature_t CPUID_FEATURE_ARAT = { .func = 0x00000006, .reg = CPUID_REG_EAX, .mask = 1 << 2 };
 static const cpuid_feature_t CPUID_FEATURE_AVX2 = { .func = 0x00000007, .reg = CPUID_REG_EBX, .mask = 1 << 5 };
+static const cpuid_feature_t CPUID_FEATURE_XSAVEOPT = { .func = 0x0000000d, .param = 1, .reg = CPUID_REG_EAX, .mask = 1 << 0 };
 
 static const cpuid_feature_t CPUID_FEATURE_LZCNT = { .func = 0x80000001, .reg = CPUID_REG_ECX, .mask = 1 << 5 };
 static const cpuid_feature_t CPUID_FEATURE_INVTSC = { .func = 0x80000007, .reg = CPUID_REG_EDX, .mask = 1 << 8 };
@@ -0,0 +1,240 @@
+/*
+    Switching of fpu/sse/avx state between tasks.
+
+    A task gets a state area the first time it uses the fpu, so tasks
+    which never do cost nothing. CR0.TS is set whenever the registers do
+    not hold the running task's state, so its first use traps with #NM.
+    In lazy mode the state is only restored then, in eager mode it is
+    restored on every switch to a task which has a state area.
+*/
+#include "fpu.h"
+#include "cpu.h"
+#include "cpuid.h"
+#include "klog.h"
+#include "lock.h"
+#include "memutils.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "proc/sched/sched.h"
+#include "sys/idt.h"
+#include "sys/panic.h"
+#include "sys/smp/smp.h"
+
+// per-cpu fpu state
+typedef struct {
+    task_t* owner; // task whose state is in the registers, may be stale
+    bool ts_clear; // CR0.TS is clear, the owner is using the fpu
+
+    // statistics
+    uint64_t nr_traps; // #NM taken
+    uint64_t nr_restores; // state areas loaded, on a trap or an eager switch
+    uint64_t nr_saves;
+} __attribute__((aligned(64))) fpu_cpu_t;
+
+static fpu_cpu_t fpu_cpus[CPU_MAX];
+static fpu_mode_t fpu_mode = FPU_LAZY;
+
+static bool has_xsave;
+static bool has_xsaveopt;
+static uint64_t xstate_mask;
+static uint64_t area_size;
+
+// cache of state areas, free ones are linked through their first word
+static lock_t cache_lock;
+static void* cache_free;
+
+static void* state_alloc()
+{
+    lock_wait(&cache_lock);
+    if (!cache_free) {
+        uint8_t* pages = (uint8_t*)PHYS_TO_VIRT(pmm_get(FPU_CACHE_PAGES));
+        for (uint64_t off = 0; off + area_size <= FPU_CACHE_PAGES * PAGE_SIZE; off += area_size) {
+            *(void**)(pages + off) = cache_free;
+            cache_free = pages + off;
+        }
+    }
+    void* area = cache_free;
+    cache_free = *(void**)area;
+    lock_release(&cache_lock);
+
+    // an empty xsave header means every component is in its initial state
+    memset(area, 0, area_size);
+    *(uint16_t*)area = FPU_DEFAULT_FCW;
+    *(uint32_t*)((uint8_t*)area + 24) = FPU_DEFAULT_MXCSR;
+    return area;
+}
+
+static void state_free(void* area)
+{
+    lock_wait(&cache_lock);
+    *(void**)area = cache_free;
+    cache_free = area;
+    lock_release(&cache_lock);
+}
+
+static inline void state_save(void* area)
+{
+    if (has_xsaveopt)
+        asm volatile("xsaveopt64 (%0)" ::"r"(area), "a"(UINT32_MAX), "d"(UINT32_MAX)
+                     : "memory");
+    else if (has_xsave)
+        asm volatile("xsave64 (%0)" ::"r"(area), "a"(UINT32_MAX), "d"(UINT32_MAX)
+                     : "memory");
+    else
+        asm volatile("fxsave64 (%0)" ::"r"(area)
+                     : "memory");
+}
+
+static inline void state_restore(void* area)
+{
+    if (has_xsave)
+        asm volatile("xrstor64 (%0)" ::"r"(area), "a"(UINT32_MAX), "d"(UINT32_MAX)
+                     : "memory");
+    else
+        asm volatile("fxrstor64 (%0)" ::"r"(area)
+                     : "memory");
+}
+
+// only touch CR0 if TS actually changes
+static inline void set_ts(fpu_cpu_t* c, bool ts)
+{
+    if (c->ts_clear == !ts)
+        return;
+    c->ts_clear = !ts;
+
+    if (!ts) {
+        asm volatile("clts");
+        return;
+    }
+    uint64_t vcr0;
+    read_cr("cr0", &vcr0);
+    vcr0 |= 1 << 3;
+    write_cr("cr0", vcr0);
+}
+
+// device not available, the current task used the fpu with CR0.TS set
+[[gnu::interrupt]] static void nm_handler(void* frame)
+{
+    (void)frame;
+    task_t* curr = sched_get_current();
+    if (!curr)
+        kernel_panic("fpu used outside of a task\n");
+
+    uint16_t cpu = smp_get_current_info()->cpu_id;
+    if (!curr->fpu_state)
+        curr->fpu_state = state_alloc();
+
+    fpu_cpu_t* c = &fpu_cpus[cpu];
+    set_ts(c, false);
+    state_restore(curr->fpu_state);
+    c->owner = curr;
+    curr->fpu_cpu = cpu;
+    c->nr_traps++;
+    c->nr_restores++;
+}
+
+// called with interrupts disabled, after next has left any other cpu
+void fpu_switch(task_t* prev, task_t* next, uint16_t cpu)
+{
+    fpu_cpu_t* c = &fpu_cpus[cpu];
+
+    // save what prev did since it was switched in, it may run elsewhere next
+    if (prev && c->ts_clear && c->owner == prev) {
+        if (prev->status == TASK_DEAD)
+            c->owner = NULL;
+        else {
+            state_save(prev->fpu_state);
+            c->nr_saves++;
+        }
+    }
+
+    // the registers still hold next's state if nobody used them since
+    if (c->owner == next && next->fpu_cpu == cpu) {
+        set_ts(c, false);
+        return;
+    }
+
+    if (fpu_mode == FPU_EAGER && next->fpu_state) {
+        set_ts(c, false);
+        state_restore(next->fpu_state);
+        c->owner = next;
+        next->fpu_cpu = cpu;
+        c->nr_restores++;
+        return;
+    }
+    set_ts(c, true);
+}
+
+// other cpus may still name it as owner, but never dereference that
+void fpu_task_free(task_t* t)
+{
+    if (t->fpu_state)
+        state_free(t->fpu_state);
+    t->fpu_state = NULL;
+}
+
+// enable xsave and the state components we support, on every cpu
+void fpu_cpu_init()
+{
+    has_xsave = cpuid_check_feature(CPUID_FEATURE_XSAVE);
+    uint64_t size = 512;
+
+    if (has_xsave) {
+        // set CR4.OSXSAVE
+        uint64_t vcr4;
+        read_cr("cr4", &vcr4);
+        vcr4 |= 1 << 18;
+        write_cr("cr4", vcr4);
+
+        // avx-512 needs all three of its components
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        xstate_mask = eax & (XSTATE_X87 | XSTATE_SSE | XSTATE_AVX | XSTATE_AVX512);
+        if ((xstate_mask & XSTATE_AVX512) != XSTATE_AVX512)
+            xstate_mask &= ~XSTATE_AVX512;
+        asm volatile("xsetbv" ::"c"(0), "a"((uint32_t)xstate_mask), "d"((uint32_t)(xstate_mask >> 32)));
+
+        // ebx now has the size needed for the enabled components
+        cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        size = ebx;
+        has_xsaveopt = cpuid_check_feature(CPUID_FEATURE_XSAVEOPT);
+    }
+    area_size = (size + 63) & ~63ULL;
+
+    // no task owns the fpu yet, so its first use should trap
+    uint64_t vcr0;
+    read_cr("cr0", &vcr0);
+    vcr0 |= 1 << 3;
+    write_cr("cr0", vcr0);
+}
+
+// look for a whole word in the kernel command line
+static bool cmdline_has(const char* cmdline, const char* opt)
+{
+    size_t len = strlen(opt);
+    for (const char* s = cmdline; *s; s++)
+        if ((s == cmdline || s[-1] == ' ') && !strncmp(s, opt, len) && (s[len] == ' ' || !s[len]))
+            return true;
+    return false;
+}
+
+void fpu_init(const char* cmdline)
+{
+    if (cmdline && cmdline_has(cmdline, "fpu=eager"))
+        fpu_mode = FPU_EAGER;
+    idt_set_handler(7, nm_handler);
+
+    klog_ok("%s switching with %s, %d byte state areas\n",
+        fpu_mode == FPU_EAGER ? "eager" : "lazy",
+        has_xsaveopt ? "xsaveopt" : (has_xsave ? "xsave" : "fxsave"), (int)area_size);
+}
+
+void fpu_dumpstats()
+{
+    klog_info("fpu statistics (%s)\n", fpu_mode == FPU_EAGER ? "eager" : "lazy");
+    uint16_t ncpus = smp_get_info()->num_cpus;
+    for (uint16_t i = 0; i < ncpus; i++)
+        klog_printf(" \t \tcpu %d: %d traps, %d restores, %d saves\n", i,
+            fpu_cpus[i].nr_traps, fpu_cpus[i].nr_restores, fpu_cpus[i].nr_saves);
+    klog_printf("\n");
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "proc/task.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// xsave state components
+#define XSTATE_X87 (1 << 0)
+#define XSTATE_SSE (1 << 1)
+#define XSTATE_AVX (1 << 2)
+#define XSTATE_AVX512 (0b111 << 5)
+
+// default control words loaded into a fresh state area
+#define FPU_DEFAULT_FCW 0x037f
+#define FPU_DEFAULT_MXCSR 0x1f80
+
+// number of pages the state area cache grows by
+#define FPU_CACHE_PAGES 4
+
+typedef enum {
+    FPU_LAZY, // restore on first use after a switch, via #NM
+    FPU_EAGER // restore on every switch to a task which has used it
+} fpu_mode_t;
+
+void fpu_cpu_init();
+void fpu_init(const char* cmdline);
+void fpu_switch(task_t* prev, task_t* next, uint16_t cpu);
+void fpu_task_free(task_t* t);
+void fpu_dumpstats();
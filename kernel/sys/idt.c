@@ -47,6 +47,7 @@ void idt_init()
     IDT[6] = idt_make_entry((uint64_t)&isr6);
     IDT[7] = idt_make_entry((uint64_t)&isr7);
     IDT[8] = idt_make_entry((uint64_t)&isr8);
+    IDT[8].flags |= IDT_IST_DOUBLE_FAULT;
     IDT[10] = idt_make_entry((uint64_t)&isr10);
     IDT[11] = idt_make_entry((uint64_t)&isr11);
     IDT[12] = idt_make_entry((uint64_t)&isr12);
@@ -6,6 +6,9 @@
 
 #define IDT_FLAGS_DEFAULT 0b1000111000000000
 
+// double faults run on tss.ist1, the faulting stack may have overflowed
+#define IDT_IST_DOUBLE_FAULT 1
+
 struct [[gnu::packed]] idt_entry {
     uint16_t offset_15_0;
     uint16_t selector;
@@ -1,8 +1,10 @@
 #include "panic.h"
+#include "apic/apic.h"
 #include "apic/timer.h"
 #include "klog.h"
 #include "lock.h"
 #include "mm/mm.h"
+#include "smp/smp.h"
 #include "symbols.h"
 #include "sys/pit.h"
 #include <stdarg.h>
@@ -63,6 +65,12 @@ _Noreturn void kernel_panic(const char* s, ...)
     // stop other cores
     apic_timer_set_handler(halt);
 
+    // idle cores may have no timer armed, so interrupt them directly
+    const smp_info_t* info = smp_get_info();
+    for (uint16_t i = 0; i < info->num_cpus; i++)
+        if (info->cpus[i].lapic_id != smp_get_current_info()->lapic_id)
+            apic_send_ipi(info->cpus[i].lapic_id, apic_timer_get_vector(), APIC_IPI_TYPE_FIXED);
+
     // wait for some time for cores to stop
     pit_wait(10);
 
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "smp.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// a set of cpus, one bit per cpu id
+typedef struct {
+    uint64_t bits[CPU_MAX / 64];
+} cpumask_t;
+
+static inline void cpumask_set(cpumask_t* m, uint16_t cpu)
+{
+    m->bits[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+static inline void cpumask_clear(cpumask_t* m, uint16_t cpu)
+{
+    m->bits[cpu / 64] &= ~(1ULL << (cpu % 64));
+}
+
+static inline bool cpumask_test(const cpumask_t* m, uint16_t cpu)
+{
+    return m->bits[cpu / 64] & (1ULL << (cpu % 64));
+}
+
+static inline void cpumask_fill(cpumask_t* m)
+{
+    for (int i = 0; i < CPU_MAX / 64; i++)
+        m->bits[i] = UINT64_MAX;
+}
+
+static inline void cpumask_zero(cpumask_t* m)
+{
+    for (int i = 0; i < CPU_MAX / 64; i++)
+        m->bits[i] = 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Per-cpu variables live in the .percpu section, which is copied for
+ * every cpu by smp_init(). The gs base of each cpu is set to the offset
+ * of its copy from the original, so a variable is reached at
+ * %gs:variable with a single instruction. Until then gs is 0, and the
+ * original is used.
+ */
+#define PER_CPU(type, name) __attribute__((section(".percpu"))) type name
+#define DECLARE_PER_CPU(type, name) extern PER_CPU(type, name)
+
+// start and end of the original, from the linker script
+extern uint8_t percpu_start[];
+extern uint8_t percpu_end[];
+
+#define this_cpu_read(var) ({                 \
+    typeof(var) __val;                        \
+    asm volatile("mov %%gs:%1, %0"            \
+                 : "=r"(__val)                \
+                 : "m"(var));                 \
+    __val;                                    \
+})
+
+#define this_cpu_write(var, val)                        \
+    asm volatile("mov %1, %%gs:%0"                      \
+                 : "+m"(var)                            \
+                 : "r"((typeof(var))(val))              \
+                 : "memory")
+
+#define this_cpu_add(var, val)                          \
+    asm volatile("add %1, %%gs:%0"                      \
+                 : "+m"(var)                            \
+                 : "r"((typeof(var))(val))              \
+                 : "memory", "cc")
+
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+#define this_cpu_dec(var) this_cpu_add(var, -1)
+
+// another cpu's copy, given the offset of it
+#define per_cpu_ptr(var, offset) ((typeof(var)*)((uint8_t*)&(var) + (offset)))
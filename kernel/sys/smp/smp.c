@@ -3,6 +3,7 @@
 #include "klog.h"
 #include "kmalloc.h"
 #include "memutils.h"
+#include "mm/kstack.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
 #include "proc/sched/sched.h"
@@ -21,6 +22,10 @@ static volatile int* ap_boot_counter = (volatile int*)PHYS_TO_VIRT(SMP_AP_BOOT_C
 
 static smp_info_t info;
 
+// used by the bsp until smp_init() gives it its entry in info
+static cpu_t early_bsp_info;
+static PER_CPU(cpu_t*, this_cpu_info) = &early_bsp_info;
+
 const smp_info_t* smp_get_info()
 {
     return &info;
@@ -28,7 +33,24 @@ const smp_info_t* smp_get_info()
 
 cpu_t* smp_get_current_info()
 {
-    return (cpu_t*)rdmsr(MSR_GS_BASE);
+    return this_cpu_read(this_cpu_info);
+}
+
+// per-cpu state is accessed through gs, until smp_init() the bsp uses
+// the original copy
+void smp_early_init()
+{
+    wrmsr(MSR_GS_BASE, 0);
+}
+
+// gives a cpu its own copy of the per-cpu data
+static void percpu_setup(cpu_t* cpuinfo)
+{
+    uint64_t size = percpu_end - percpu_start;
+    uint8_t* area = kmalloc(size);
+    memcpy(percpu_start, area, size);
+    cpuinfo->percpu_offset = area - percpu_start;
+    *per_cpu_ptr(this_cpu_info, cpuinfo->percpu_offset) = cpuinfo;
 }
 
 static void init_tss(cpu_t* cpuinfo)
@@ -50,8 +72,8 @@ _Noreturn void smp_ap_entrypoint(cpu_t* cpuinfo)
     gdt_init();
     init_tss(cpuinfo);
 
-    // put cpu information in gs
-    wrmsr(MSR_GS_BASE, (uint64_t)cpuinfo);
+    // switch to our copy of the per-cpu data
+    wrmsr(MSR_GS_BASE, cpuinfo->percpu_offset);
 
     // enable the apic
     apic_enable();
@@ -106,12 +128,14 @@ void smp_init()
 
         info.cpus[info.num_cpus].lapic_id = lapics[i]->apic_id;
         info.cpus[info.num_cpus].cpu_id = info.num_cpus;
+        info.cpus[info.num_cpus].tss.ist1 = (uint64_t)kstack_alloc() + KSTACK_SIZE;
 
         // if cpu is the bootstrap processor, do not initialize it
         if (apic_read_reg(APIC_REG_ID) == lapics[i]->apic_id) {
             klog_info("core %d is BSP\n", lapics[i]->proc_id);
             info.cpus[info.num_cpus].is_bsp = true;
-            wrmsr(MSR_GS_BASE, (uint64_t)&info.cpus[info.num_cpus]);
+            percpu_setup(&info.cpus[info.num_cpus]);
+            wrmsr(MSR_GS_BASE, info.cpus[info.num_cpus].percpu_offset);
             init_tss(&info.cpus[info.num_cpus]);
             info.num_cpus++;
             continue;
@@ -120,8 +144,10 @@ void smp_init()
         klog_info("initializing core %d...", lapics[i]->proc_id);
 
         // allocate and pass the stack
-        void* stack = kmalloc(PAGE_SIZE);
-        *((uint64_t*)PHYS_TO_VIRT(SMP_TRAMPOLINE_ARG_RSP)) = (uint64_t)stack + PAGE_SIZE;
+        void* stack = kstack_alloc();
+        *((uint64_t*)PHYS_TO_VIRT(SMP_TRAMPOLINE_ARG_RSP)) = (uint64_t)stack + KSTACK_SIZE;
+
+        percpu_setup(&info.cpus[info.num_cpus]);
 
         // pass cpu information
         *((uint64_t*)PHYS_TO_VIRT(SMP_TRAMPOLINE_ARG_CPUINFO)) = (uint64_t)&info.cpus[info.num_cpus];
@@ -148,7 +174,9 @@ void smp_init()
 
         if (!success) {
             klog_printf(" failed\n");
-            kmfree(stack);
+            kstack_free(stack);
+            kmfree(percpu_start + info.cpus[info.num_cpus].percpu_offset);
+            kstack_free((void*)(info.cpus[info.num_cpus].tss.ist1 - KSTACK_SIZE));
         } else {
             info.cpus[info.num_cpus].is_bsp = false;
             info.num_cpus++;
@@ -160,3 +188,26 @@ void smp_init()
     // identity mapping is no longer needed
     vmm_unmap(NULL, 0, NUM_PAGES(0x100000));
 }
+
+// compares finding the current task through a gs-relative read with the
+// rdmsr of the gs base it used to take
+void smp_percpu_benchmark()
+{
+    uint64_t flags = lock_irq_save();
+    uint64_t sink = 0;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SMP_PERCPU_BENCH_CALLS; i++)
+        sink += (uint64_t)sched_get_current();
+    uint64_t gs_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < SMP_PERCPU_BENCH_CALLS; i++)
+        sink += rdmsr(MSR_GS_BASE);
+    uint64_t msr_cycles = rdtsc() - start;
+
+    lock_irq_restore(flags);
+    asm volatile("" ::"r"(sink));
+    klog_info("current task in %d cycles with a gs read, %d with rdmsr\n\n",
+        gs_cycles / SMP_PERCPU_BENCH_CALLS, msr_cycles / SMP_PERCPU_BENCH_CALLS);
+}
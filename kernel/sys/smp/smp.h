@@ -1,5 +1,6 @@
 #pragma once
 
+#include "percpu.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -32,10 +33,14 @@ typedef struct [[gnu::packed]] {
     uint32_t iopb_offset;
 } tss_t;
 
+// reads of the current task timed by smp_percpu_benchmark()
+#define SMP_PERCPU_BENCH_CALLS 100000
+
 typedef struct {
     uint16_t cpu_id;
     uint16_t lapic_id;
     bool is_bsp;
+    uint64_t percpu_offset; // from the original .percpu to this cpu's copy
     tss_t tss;
 } cpu_t;
 
@@ -45,6 +50,11 @@ typedef struct {
     cpu_t cpus[CPU_MAX];
 } smp_info_t;
 
+void smp_early_init();
 void smp_init();
 const smp_info_t* smp_get_info();
 cpu_t* smp_get_current_info();
+void smp_percpu_benchmark();
+
+// another cpu's copy of a per-cpu variable
+#define per_cpu(var, cpu) per_cpu_ptr(var, smp_get_info()->cpus[cpu].percpu_offset)